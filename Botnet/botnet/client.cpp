@@ -30,6 +30,9 @@ void printUsage() {
     std::cout << "GETMSG                          - Get a message for your group" << std::endl;
     std::cout << "SENDMSG,<group_id>,<message>    - Send message to another group" << std::endl;
     std::cout << "LISTSERVERS                     - List connected servers" << std::endl;
+    std::cout << "STATS                           - Show server metrics" << std::endl;
+    std::cout << "STATS,LOCKS                     - Show serverMutex contention per call site" << std::endl;
+    std::cout << "TRACE                           - Write the server's span trace (Chrome JSON)" << std::endl;
     std::cout << "QUIT                            - Exit client" << std::endl;
     std::cout << "======================\n" << std::endl;
 }
@@ -212,8 +215,51 @@ int main(int argc, char* argv[]) {
                 break; // Exit if send failed
             }
         }
+        else if(tokens[0] == "STATS") {
+            // Server replies with STATS frames (one metric per line) and a closing STATS_END
+            std::string cmd = tokens.size() >= 2 ? "STATS," + tokens[1] : "STATS";
+            if(sendCommand(serverSocket, cmd)) {
+                logMessage("Sent: " + cmd);
+                
+                std::string response;
+                bool ok = false;
+                while(receiveCommand(serverSocket, response)) {
+                    if(response == "STATS_END") { ok = true; break; }
+                    if(response.compare(0, 6, "STATS\n") == 0) std::cout << response.substr(6) << std::endl;
+                    else std::cout << response << std::endl;
+                }
+                if(!ok) {
+                    logMessage("ERROR: Failed to receive response or connection closed");
+                    break; // Exit if connection lost
+                }
+            } else {
+                logMessage("ERROR: Failed to send STATS");
+                break; // Exit if send failed
+            }
+        }
+        else if(tokens[0] == "TRACE") {
+            // Server writes its trace file and replies OK,<path>,<spans> or ERROR,<reason>
+            if(sendCommand(serverSocket, "TRACE")) {
+                logMessage("Sent: TRACE");
+                
+                std::string response;
+                if(receiveCommand(serverSocket, response)) {
+                    logMessage("Received: " + response);
+                    std::vector<std::string> respTokens = parseCommand(response);
+                    if(respTokens.size() >= 3 && respTokens[0] == "OK")
+                        std::cout << "Trace of " << respTokens[2] << " spans written to " << respTokens[1] << std::endl;
+                    else std::cout << response << std::endl;
+                } else {
+                    logMessage("ERROR: Failed to receive response or connection closed");
+                    break; // Exit if connection lost
+                }
+            } else {
+                logMessage("ERROR: Failed to send TRACE");
+                break; // Exit if send failed
+            }
+        }
         else {
-            std::cout << "Unknown command. Type one of: GETMSG, SENDMSG, LISTSERVERS, QUIT" << std::endl;
+            std::cout << "Unknown command. Type one of: GETMSG, SENDMSG, LISTSERVERS, STATS, TRACE, QUIT" << std::endl;
         }
     }
 
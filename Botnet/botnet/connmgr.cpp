@@ -0,0 +1,105 @@
+#include "connmgr.h"
+#include <algorithm>
+
+const uint64_t BACKOFF_BASE_MS = 2000;
+const uint64_t BACKOFF_MAX_MS = 300000;
+
+ConnectionManager::ConnectionManager(const PeerTargets &targets) : targets(targets) {}
+
+std::string ConnectionManager::key(const std::string &ip, int port) {
+    return ip + ":" + std::to_string(port);
+}
+
+std::string ConnectionManager::key(const DialCandidate &candidate) {
+    return key(candidate.ip, candidate.port);
+}
+
+uint64_t ConnectionManager::interval(int failures) {
+    return std::min(BACKOFF_BASE_MS << std::min(std::max(failures - 1, 0), 10), BACKOFF_MAX_MS);
+}
+
+bool ConnectionManager::inBackoff(const DialCandidate &candidate, uint64_t nowMs) const {
+    auto it = backoff.find(key(candidate));
+    return it != backoff.end() && it->second.retryAtMs > nowMs;
+}
+
+int ConnectionManager::failures(const DialCandidate &candidate) const {
+    auto it = backoff.find(key(candidate));
+    return it != backoff.end() ? it->second.failures : 0;
+}
+
+std::vector<DialCandidate> ConnectionManager::pickCandidates(const std::vector<DialCandidate> &candidates,
+                                                             int students, int instructors, uint64_t nowMs) const {
+    std::vector<DialCandidate> picks;
+    int total = students + instructors;
+    int room = targets.maxPeers - total;
+    if (room <= 0) return picks;
+
+    // Fewest recent failures first, then best scored, then most recently heard of
+    std::vector<DialCandidate> eligible;
+    for (const auto &c : candidates)
+        if (!inBackoff(c, nowMs)) eligible.push_back(c);
+    std::stable_sort(eligible.begin(), eligible.end(), [this](const DialCandidate &a, const DialCandidate &b) {
+        int fa = failures(a), fb = failures(b);
+        if (fa != fb) return fa < fb;
+        return a.score != b.score ? a.score > b.score : a.lastHeard > b.lastHeard;
+    });
+
+    int wantStudents = std::max(0, targets.preferredStudents - students);
+    int wantInstructors = std::max(0, targets.preferredInstructors - instructors);
+    std::vector<bool> taken(eligible.size(), false);
+    for (size_t i = 0; i < eligible.size() && (int)picks.size() < room; i++) {
+        int &want = eligible[i].isInstructor ? wantInstructors : wantStudents;
+        if (want > 0) { picks.push_back(eligible[i]); taken[i] = true; want--; }
+    }
+
+    // Any kind counts towards the minimum degree
+    int fill = targets.minPeers - total - (int)picks.size();
+    for (size_t i = 0; i < eligible.size() && fill > 0 && (int)picks.size() < room; i++) {
+        if (!taken[i]) { picks.push_back(eligible[i]); fill--; }
+    }
+    return picks;
+}
+
+uint64_t ConnectionManager::nextRetryMs(const std::vector<DialCandidate> &candidates, uint64_t nowMs) const {
+    uint64_t next = 0;
+    for (const auto &c : candidates) {
+        auto it = backoff.find(key(c));
+        if (it != backoff.end() && it->second.retryAtMs > nowMs && (next == 0 || it->second.retryAtMs < next))
+            next = it->second.retryAtMs;
+    }
+    return next;
+}
+
+void ConnectionManager::recordFailure(const DialCandidate &candidate, uint64_t nowMs) {
+    Backoff &b = backoff[key(candidate)];
+    b.failures++;
+    b.retryAtMs = nowMs + interval(b.failures);
+    b.connectedAtMs = 0;
+}
+
+// The failure count stays until the connection has proved itself (see recordDisconnect),
+// and the address is not redialed within one interval even if it drops at once
+void ConnectionManager::recordSuccess(const DialCandidate &candidate, uint64_t nowMs) {
+    Backoff &b = backoff[key(candidate)];
+    b.connectedAtMs = nowMs;
+    b.retryAtMs = nowMs + interval(b.failures);
+}
+
+void ConnectionManager::recordDisconnect(const std::string &ip, int port, uint64_t nowMs) {
+    auto it = backoff.find(key(ip, port));
+    if (it == backoff.end() || it->second.connectedAtMs == 0) return;
+    Backoff &b = it->second;
+    if (nowMs - b.connectedAtMs >= interval(b.failures)) {
+        backoff.erase(it);
+        return;
+    }
+    // Accepted and dropped: as good as a failed dial
+    b.failures++;
+    b.retryAtMs = nowMs + interval(b.failures);
+    b.connectedAtMs = 0;
+}
+
+void ConnectionManager::forget(const std::string &ip, int port) {
+    backoff.erase(key(ip, port));
+}
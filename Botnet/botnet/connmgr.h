@@ -0,0 +1,97 @@
+#ifndef CONNMGR_H
+#define CONNMGR_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <ctime>
+
+/**
+ * Desired peer degree
+ */
+struct PeerTargets {
+    int minPeers;              // Dial immediately whenever we drop below this
+    int maxPeers;              // Never dial beyond this
+    int preferredStudents;     // Student peers we aim for
+    int preferredInstructors;  // Instructor peers we aim for
+};
+
+/**
+ * A server we could dial
+ */
+struct DialCandidate {
+    std::string groupId, ip;  // groupId is empty for servers only seen by a port scan
+    int port;
+    bool isInstructor;
+    time_t lastHeard;
+    double score;  // Neighbor score from measured metrics; higher is dialed first
+};
+
+/**
+ * Connection policy: which candidates to dial to reach the target degree,
+ * and per-candidate exponential backoff so a dead address is retried
+ * after 2 s, 4 s, 8 s ... up to 5 minutes instead of on every pass.
+ * A connection that closes within one backoff interval of opening counts
+ * as another failure; only one that stays up longer clears the backoff.
+ *
+ * Not thread-safe; the server uses it under serverMutex.
+ */
+class ConnectionManager {
+public:
+    explicit ConnectionManager(const PeerTargets &targets);
+
+    PeerTargets targets;
+
+    /**
+     * Pick the candidates to dial now, best first (fewest recent failures,
+     * then highest score, then most recently heard of).
+     * Fills preferred student/instructor slots first, then any kind up to
+     * minPeers, and never beyond maxPeers. Candidates in backoff are skipped.
+     *
+     * @param candidates Servers we are not connected to
+     * @param students Connected student peers
+     * @param instructors Connected instructor peers
+     * @param nowMs Current monotonic time
+     */
+    std::vector<DialCandidate> pickCandidates(const std::vector<DialCandidate> &candidates,
+                                              int students, int instructors, uint64_t nowMs) const;
+
+    /**
+     * Earliest time a candidate leaves backoff, or 0 if none is waiting
+     */
+    uint64_t nextRetryMs(const std::vector<DialCandidate> &candidates, uint64_t nowMs) const;
+
+    /**
+     * Record the outcome of a dial
+     */
+    void recordFailure(const DialCandidate &candidate, uint64_t nowMs);
+    void recordSuccess(const DialCandidate &candidate, uint64_t nowMs);
+
+    /**
+     * A peer connection closed; addresses we never dialed are ignored
+     */
+    void recordDisconnect(const std::string &ip, int port, uint64_t nowMs);
+
+    /**
+     * Drop an address's backoff, e.g. once it leaves the server directory
+     */
+    void forget(const std::string &ip, int port);
+
+private:
+    struct Backoff {
+        int failures;
+        uint64_t retryAtMs;
+        uint64_t connectedAtMs;  // 0 unless our dial is currently connected
+    };
+
+    static std::string key(const std::string &ip, int port);
+    static std::string key(const DialCandidate &candidate);
+    static uint64_t interval(int failures);  // Backoff after this many failures (the base for none)
+    bool inBackoff(const DialCandidate &candidate, uint64_t nowMs) const;
+    int failures(const DialCandidate &candidate) const;
+
+    std::map<std::string, Backoff> backoff;  // Keyed by ip:port
+};
+
+#endif // CONNMGR_H
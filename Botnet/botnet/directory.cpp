@@ -0,0 +1,103 @@
+#include "directory.h"
+
+const int EVICT_SAMPLE = 8;  // Least recently heard entries considered per eviction
+
+ServerDirectory::ServerDirectory(size_t capacity) : capacity(capacity > 0 ? capacity : 1), currentVersion(0) {}
+
+std::string ServerDirectory::key(const std::string &ip, int port) {
+    return ip + ":" + std::to_string(port);
+}
+
+void ServerDirectory::touch(DirectoryEntry &entry, time_t heard) {
+    if (heard <= entry.lastHeard) return;
+    std::string k = key(entry.ip, entry.port);
+    lru.erase({entry.lastHeard, k});
+    entry.lastHeard = heard;
+    lru.insert({heard, k});
+    bump(entry, k);
+}
+
+void ServerDirectory::bump(DirectoryEntry &entry, const std::string &k) {
+    byVersion.erase({entry.version, k});
+    entry.version = ++currentVersion;
+    byVersion.insert({entry.version, k});
+}
+
+void ServerDirectory::remove(const std::string &k) {
+    auto it = entries.find(k);
+    if (it == entries.end()) return;
+    const DirectoryEntry &e = it->second;
+    if (!e.groupId.empty()) {
+        auto g = byGroup.find(e.groupId);
+        if (g != byGroup.end() && g->second == k) byGroup.erase(g);
+    }
+    lru.erase({e.lastHeard, k});
+    byVersion.erase({e.version, k});
+    if (onRemove) onRemove(e);
+    entries.erase(it);
+}
+
+void ServerDirectory::evictOne() {
+    std::string victim;
+    double worst = 0;
+    int seen = 0;
+    for (auto it = lru.begin(); it != lru.end() && seen < EVICT_SAMPLE; ++it) {
+        const DirectoryEntry &e = entries.at(it->second);
+        if (pinned && pinned(e)) continue;
+        seen++;
+        double q = quality ? quality(e) : 0;
+        if (victim.empty() || q < worst) { victim = it->second; worst = q; }
+    }
+    if (!victim.empty()) remove(victim);
+}
+
+bool ServerDirectory::upsert(const std::string &groupId, const std::string &ip, int port, time_t heard) {
+    std::string k = key(ip, port);
+
+    // A group that moved: drop its old address
+    if (!groupId.empty()) {
+        auto g = byGroup.find(groupId);
+        if (g != byGroup.end() && g->second != k) remove(g->second);
+    }
+
+    auto it = entries.find(k);
+    if (it != entries.end()) {
+        DirectoryEntry &e = it->second;
+        touch(e, heard);
+        if (groupId.empty() || groupId == e.groupId) return false;
+        if (!e.groupId.empty()) byGroup.erase(e.groupId);
+        e.groupId = groupId;
+        byGroup[groupId] = k;
+        bump(e, k);
+        return true;
+    }
+
+    if (entries.size() >= capacity) evictOne();
+    DirectoryEntry &e = entries[k];
+    e = {groupId, ip, port, heard, 0};
+    if (!groupId.empty()) byGroup[groupId] = k;
+    lru.insert({heard, k});
+    bump(e, k);
+    return true;
+}
+
+const DirectoryEntry *ServerDirectory::findByGroup(const std::string &groupId) const {
+    auto g = byGroup.find(groupId);
+    return g != byGroup.end() ? &entries.at(g->second) : nullptr;
+}
+
+const DirectoryEntry *ServerDirectory::findByAddress(const std::string &ip, int port) const {
+    auto it = entries.find(key(ip, port));
+    return it != entries.end() ? &it->second : nullptr;
+}
+
+std::vector<DirectoryEntry> ServerDirectory::changedSince(uint64_t sinceVersion) const {
+    std::vector<DirectoryEntry> changed;
+    for (auto it = byVersion.upper_bound({sinceVersion, std::string()}); it != byVersion.end(); ++it)
+        if (it->first > sinceVersion) changed.push_back(entries.at(it->second));
+    return changed;
+}
+
+void ServerDirectory::forEach(const std::function<void(const DirectoryEntry &entry)> &visit) const {
+    for (const auto &p : entries) visit(p.second);
+}
@@ -0,0 +1,99 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <ctime>
+
+/**
+ * A server we know about
+ */
+struct DirectoryEntry {
+    std::string groupId, ip;  // groupId is empty until a SERVERS list or handshake names it
+    int port;
+    time_t lastHeard;
+    uint64_t version;         // Directory version at the entry's last change
+};
+
+/**
+ * Known-server directory indexed by address (ip:port) and by group ID.
+ * Upserts and lookups are O(1) on average. The size is bounded: when
+ * full, the least recently heard entries that are not pinned are sampled
+ * and the one with the lowest quality is evicted.
+ *
+ * Every insert, rename, move or newer lastHeard bumps a version counter
+ * and stamps the entry, so a caller can remember version() and later
+ * fetch only what changed. Removals are reported through onRemove.
+ *
+ * Not thread-safe; the server uses it under serverMutex.
+ */
+class ServerDirectory {
+public:
+    typedef std::function<double(const DirectoryEntry &entry)> QualityFn;
+
+    /**
+     * @param capacity Maximum entries kept
+     */
+    explicit ServerDirectory(size_t capacity);
+
+    /**
+     * Ranks eviction candidates; lower goes first. Unset means pure LRU.
+     */
+    QualityFn quality;
+
+    /**
+     * Entries it returns true for (live connections) are never evicted
+     */
+    std::function<bool(const DirectoryEntry &entry)> pinned;
+
+    /**
+     * Called for every entry that leaves the directory (evicted, or its group moved)
+     */
+    std::function<void(const DirectoryEntry &entry)> onRemove;
+
+    /**
+     * Insert or refresh a server. An empty groupId never clears a known one.
+     * If the group is already known at another address, that entry moves here.
+     * @return true if the entry is new or its group/address changed
+     */
+    bool upsert(const std::string &groupId, const std::string &ip, int port, time_t heard);
+
+    /**
+     * @return The entry, or nullptr (invalidated by the next upsert)
+     */
+    const DirectoryEntry *findByGroup(const std::string &groupId) const;
+    const DirectoryEntry *findByAddress(const std::string &ip, int port) const;
+
+    /**
+     * Entries changed after sinceVersion, oldest change first
+     */
+    std::vector<DirectoryEntry> changedSince(uint64_t sinceVersion) const;
+
+    /**
+     * Visit every entry (unspecified order)
+     */
+    void forEach(const std::function<void(const DirectoryEntry &entry)> &visit) const;
+
+    uint64_t version() const { return currentVersion; }
+    size_t size() const { return entries.size(); }
+
+private:
+    static std::string key(const std::string &ip, int port);
+    void touch(DirectoryEntry &entry, time_t heard);
+    void bump(DirectoryEntry &entry, const std::string &k);
+    void remove(const std::string &k);
+    void evictOne();
+
+    size_t capacity;
+    uint64_t currentVersion;
+    std::unordered_map<std::string, DirectoryEntry> entries;  // ip:port -> entry
+    std::unordered_map<std::string, std::string> byGroup;     // groupId -> ip:port
+    std::set<std::pair<time_t, std::string>> lru;             // (lastHeard, ip:port)
+    std::set<std::pair<uint64_t, std::string>> byVersion;     // (version, ip:port)
+};
+
+#endif // DIRECTORY_H
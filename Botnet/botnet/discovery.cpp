@@ -0,0 +1,119 @@
+#include "discovery.h"
+#include "scanner.h"
+#include "timerwheel.h"
+#include <iostream>
+#include <map>
+#include <time.h>
+
+const int IDLE_WAIT_MS = 60000;  // Recheck for requests when not running continuously
+
+DiscoveryService::DiscoveryService(const DiscoveryConfig &config, FoundCallback onFound)
+    : config(config), onFound(onFound), sweepRequested(false), probeCount(0) {
+    pthread_mutex_init(&mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void DiscoveryService::addRange(const std::string &ip, int startPort, int endPort, int skipPort) {
+    pthread_mutex_lock(&mutex);
+    for (int port = startPort; port <= endPort; port++) {
+        if (port == skipPort) continue;
+        targets.push_back({ip, port, 0});
+        order.insert({0, targets.size() - 1});
+    }
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+void DiscoveryService::requestSweep() {
+    pthread_mutex_lock(&mutex);
+    sweepRequested = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+bool DiscoveryService::start() {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run, this) != 0) return false;
+    pthread_detach(tid);
+    return true;
+}
+
+uint64_t DiscoveryService::probed() {
+    pthread_mutex_lock(&mutex);
+    uint64_t n = probeCount;
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+void *DiscoveryService::run(void *arg) {
+    static_cast<DiscoveryService *>(arg)->loop();
+    return NULL;
+}
+
+// Caller holds mutex. A requested sweep takes every port older than sweepMinAgeMs,
+// a background batch the batchSize least recently checked ones.
+std::vector<size_t> DiscoveryService::nextBatchLocked(uint64_t nowMs) {
+    std::vector<size_t> batch;
+    if (sweepRequested) {
+        sweepRequested = false;
+        for (const auto &e : order) {
+            if (e.first != 0 && nowMs - e.first < static_cast<uint64_t>(config.sweepMinAgeMs)) break;
+            batch.push_back(e.second);
+        }
+    } else {
+        for (auto it = order.begin(); it != order.end() && (int)batch.size() < config.batchSize; ++it)
+            batch.push_back(it->second);
+    }
+    return batch;
+}
+
+void DiscoveryService::loop() {
+    uint64_t nextBatchMs = 0;
+    pthread_mutex_lock(&mutex);
+    while (true) {
+        uint64_t now = monotonicMillis();
+        bool due = config.continuous && now >= nextBatchMs;
+        if (!sweepRequested && !due) {
+            uint64_t wakeMs = config.continuous ? nextBatchMs : now + IDLE_WAIT_MS;
+            struct timespec ts;
+            ts.tv_sec = wakeMs / 1000;
+            ts.tv_nsec = (wakeMs % 1000) * 1000000;
+            pthread_cond_timedwait(&cond, &mutex, &ts);
+            continue;
+        }
+        if (due) nextBatchMs = now + config.batchIntervalMs;
+        bool sweep = sweepRequested;
+        std::vector<size_t> batch = nextBatchLocked(now);
+        std::map<std::string, std::vector<int>> byIp;
+        for (size_t i : batch) byIp[targets[i].ip].push_back(targets[i].port);
+        bool syn = config.synScan;
+        pthread_mutex_unlock(&mutex);
+
+        // Probe without the lock so requests and new ranges are never held up
+        std::vector<std::pair<std::string, int>> found;
+        for (const auto &p : byIp) {
+            const std::string &ip = p.first;
+            auto collect = [&](int port, bool open) { if (open) found.push_back({ip, port}); };
+            if (!syn || !synSweepPorts(ip, p.second, 2000, -1, collect))
+                sweepPorts(ip, p.second, 256, -1, collect);
+        }
+        uint64_t done = monotonicMillis();
+        // Background batches stay quiet unless they find something
+        if (!batch.empty() && (sweep || !found.empty()))
+            std::cout << "[DISCOVERY] Probed " << batch.size() << " ports in " << (done - now) << "ms, "
+                      << found.size() << " open" << std::endl;
+        for (const auto &f : found) onFound(f.first, f.second);
+
+        pthread_mutex_lock(&mutex);
+        for (size_t i : batch) {
+            order.erase({targets[i].lastCheckedMs, i});
+            targets[i].lastCheckedMs = done;
+            order.insert({done, i});
+        }
+        probeCount += batch.size();
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <functional>
+#include <cstdint>
+#include <pthread.h>
+
+/**
+ * How the discovery service paces its probes
+ */
+struct DiscoveryConfig {
+    int batchSize;        // Ports probed per background batch
+    int batchIntervalMs;  // Gap between background batches
+    int sweepMinAgeMs;    // A requested sweep skips ports checked more recently than this
+    bool synScan;         // Half-open probes when we have CAP_NET_RAW
+    bool continuous;      // Keep rescanning in the background, not only on request
+};
+
+/**
+ * Port discovery on its own thread.
+ * Every port in the registered ranges sits in a queue ordered by when it
+ * was last checked; each batch probes the least recently checked ports
+ * and puts them back at the end, so ranges are rescanned incrementally
+ * instead of in one long blocking pass. Open ports are handed to the
+ * callback from the discovery thread, never blocking the caller.
+ */
+class DiscoveryService {
+public:
+    typedef std::function<void(const std::string &ip, int port)> FoundCallback;
+
+    /**
+     * @param config Pacing; may be changed until start()
+     * @param onFound Called for every open port a batch finds
+     */
+    DiscoveryService(const DiscoveryConfig &config, FoundCallback onFound);
+
+    DiscoveryConfig config;
+
+    /**
+     * Queue every port of ip:startPort..endPort except skipPort
+     */
+    void addRange(const std::string &ip, int startPort, int endPort, int skipPort);
+
+    /**
+     * Ask for every port not checked within sweepMinAgeMs to be probed now.
+     * Returns immediately; repeated requests before the sweep runs coalesce.
+     */
+    void requestSweep();
+
+    /**
+     * Start the discovery thread
+     * @return false if the thread could not be created
+     */
+    bool start();
+
+    /**
+     * Ports probed since start
+     */
+    uint64_t probed();
+
+private:
+    struct Target {
+        std::string ip;
+        int port;
+        uint64_t lastCheckedMs;  // 0 = never
+    };
+
+    static void *run(void *arg);
+    void loop();
+    std::vector<size_t> nextBatchLocked(uint64_t nowMs);
+
+    FoundCallback onFound;
+    std::vector<Target> targets;
+    std::set<std::pair<uint64_t, size_t>> order;  // (lastCheckedMs, index), least recently checked first
+    bool sweepRequested;
+    uint64_t probeCount;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+#endif // DISCOVERY_H
@@ -0,0 +1,33 @@
+#include "failuredetect.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+
+bool enableFailureDetection(int sock, int detectSeconds) {
+    // Half the budget idle, the rest split over three unanswered probes
+    int on = 1;
+    int idle = std::max(1, detectSeconds / 2);
+    int count = 3;
+    int interval = std::max(1, (detectSeconds - idle) / count);
+    unsigned int userTimeout = static_cast<unsigned int>(std::max(1, detectSeconds)) * 1000;
+
+    bool ok = true;
+    ok &= setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == 0;
+    ok &= setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == 0;
+    ok &= setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == 0;
+    ok &= setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) == 0;
+    ok &= setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout)) == 0;
+    return ok;
+}
+
+int completeProbe(ProbeState &probe, uint64_t nowMs) {
+    if (!probe.outstanding) return -1;
+    probe.outstanding = false;
+    probe.lastRttMs = static_cast<int>(nowMs - probe.sentAtMs);
+    return probe.lastRttMs;
+}
+
+bool probeTimedOut(const ProbeState &probe, uint64_t nowMs, int detectSeconds) {
+    return probe.outstanding && nowMs - probe.sentAtMs > static_cast<uint64_t>(detectSeconds) * 1000;
+}
@@ -0,0 +1,41 @@
+#ifndef FAILUREDETECT_H
+#define FAILUREDETECT_H
+
+#include <cstdint>
+
+/**
+ * Let the kernel detect a dead peer within roughly detectSeconds:
+ * SO_KEEPALIVE with TCP_KEEPIDLE/TCP_KEEPINTVL/TCP_KEEPCNT for idle links,
+ * and TCP_USER_TIMEOUT so unacknowledged data fails the socket instead of
+ * retransmitting for ~15 minutes. A dead socket makes recv() return an
+ * error, which runs the normal disconnect path.
+ *
+ * @param sock Connected TCP socket
+ * @param detectSeconds Target detection time in seconds
+ * @return true if all options were applied
+ */
+bool enableFailureDetection(int sock, int detectSeconds);
+
+/**
+ * Application-level ping/pong state for one peer.
+ * STATUSREQ is the ping and STATUSRESP the pong, since every peer
+ * implementation already answers those.
+ */
+struct ProbeState {
+    uint64_t sentAtMs;   // When the outstanding probe was sent
+    bool outstanding;    // Waiting for a reply
+    int lastRttMs;       // Last measured round trip, -1 if none yet
+};
+
+/**
+ * Record a reply to the outstanding probe
+ * @return Measured RTT in ms, or -1 if no probe was outstanding
+ */
+int completeProbe(ProbeState &probe, uint64_t nowMs);
+
+/**
+ * Check whether the outstanding probe has waited longer than detectSeconds
+ */
+bool probeTimedOut(const ProbeState &probe, uint64_t nowMs, int detectSeconds);
+
+#endif // FAILUREDETECT_H
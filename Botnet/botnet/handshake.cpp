@@ -0,0 +1,218 @@
+#include "handshake.h"
+#include "protocol.h"
+#include "timerwheel.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+
+enum HandshakeState { CONNECTING, AWAIT_HELO_REPLY, AWAIT_SERVERS };
+
+struct Attempt {
+    HandshakeResult result;
+    HandshakeState state;
+    std::string out;  // Bytes still to send
+    std::string in;   // Partial incoming frame
+    uint64_t startMs, deadlineMs;
+};
+
+// Process-wide slots so concurrent callers share one in-flight limit
+static pthread_mutex_t slotMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slotCond = PTHREAD_COND_INITIALIZER;
+static int slotLimit = 16, slotsInUse = 0;
+
+void setHandshakeConcurrency(int maxInFlight) {
+    pthread_mutex_lock(&slotMutex);
+    slotLimit = maxInFlight > 0 ? maxInFlight : 1;
+    pthread_cond_broadcast(&slotCond);
+    pthread_mutex_unlock(&slotMutex);
+}
+
+static bool acquireSlot(bool wait) {
+    pthread_mutex_lock(&slotMutex);
+    while (wait && slotsInUse >= slotLimit) pthread_cond_wait(&slotCond, &slotMutex);
+    bool ok = slotsInUse < slotLimit;
+    if (ok) slotsInUse++;
+    pthread_mutex_unlock(&slotMutex);
+    return ok;
+}
+
+static void releaseSlot() {
+    pthread_mutex_lock(&slotMutex);
+    slotsInUse--;
+    pthread_cond_signal(&slotCond);
+    pthread_mutex_unlock(&slotMutex);
+}
+
+static void watch(int ep, int fd, const Attempt &a) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (a.state == CONNECTING || !a.out.empty()) ? EPOLLOUT : EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+}
+
+// Send as much of the pending output as the socket takes; false on error
+static bool flush(int fd, Attempt &a) {
+    while (!a.out.empty()) {
+        ssize_t n = send(fd, a.out.data(), a.out.size(), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0) return false;
+        a.out.erase(0, n);
+    }
+    return true;
+}
+
+// Read at most the rest of the current frame; 1 = frame ready, 0 = wait, -1 = error
+static int readFrame(int fd, Attempt &a, std::string &command) {
+    while (true) {
+        int needed = frameBytesNeeded(a.in);
+        if (needed < 0) return -1;
+        if (needed == 0) return extractFrame(a.in, command);
+
+        char buf[MAX_MESSAGE_LENGTH];
+        ssize_t n = recv(fd, buf, needed, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        a.in.append(buf, n);
+    }
+}
+
+void runHandshakes(const std::vector<HandshakeTarget> &targets, const HandshakeHooks &hooks, int timeoutMs) {
+    int ep = epoll_create1(0);
+    if (ep < 0) {
+        for (const auto &t : targets) {
+            HandshakeResult r = {t, -1, "", "", "epoll_create1 failed", 0, 0};
+            hooks.onDone(r);
+        }
+        return;
+    }
+
+    std::map<int, Attempt> active;
+    size_t next = 0;
+
+    auto finish = [&](int fd, const std::string &error) {
+        Attempt &a = active[fd];
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+        if (error.empty()) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+            a.result.sock = fd;
+            a.result.handshakeMs = monotonicMillis() - a.startMs;
+        } else {
+            close(fd);
+            a.result.sock = -1;
+            a.result.error = error;
+        }
+        HandshakeResult result = a.result;
+        active.erase(fd);
+        releaseSlot();
+        hooks.onDone(result);
+    };
+
+    while (next < targets.size() || !active.empty()) {
+        // Start attempts while slots are free; block for one only if nothing is running
+        while (next < targets.size() && acquireSlot(active.empty())) {
+            const HandshakeTarget &t = targets[next++];
+            Attempt a;
+            a.result = {t, -1, "", "", "", 0, 0};
+            a.state = CONNECTING;
+            a.startMs = monotonicMillis();
+            a.deadlineMs = a.startMs + timeoutMs;
+
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(t.port);
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            std::string error;
+            if (fd < 0) error = "socket failed";
+            else if (inet_pton(AF_INET, t.ip.c_str(), &addr.sin_addr) <= 0) error = "bad address";
+            else {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+                if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+                    error = strerror(errno);
+            }
+            if (!error.empty()) {
+                if (fd >= 0) close(fd);
+                a.result.error = error;
+                releaseSlot();
+                hooks.onDone(a.result);
+                continue;
+            }
+
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT;
+            ev.data.fd = fd;
+            epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+            active[fd] = a;
+        }
+        if (active.empty()) continue;
+
+        uint64_t now = monotonicMillis(), soonest = UINT64_MAX;
+        for (const auto &p : active) soonest = std::min(soonest, p.second.deadlineMs);
+        int wait = soonest > now ? static_cast<int>(soonest - now) : 0;
+
+        struct epoll_event events[64];
+        int n = epoll_wait(ep, events, 64, wait);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            auto it = active.find(fd);
+            if (it == active.end()) continue;
+            Attempt &a = it->second;
+
+            if (a.state == CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) { finish(fd, strerror(err)); continue; }
+                a.result.connectMs = monotonicMillis() - a.startMs;
+                a.state = AWAIT_HELO_REPLY;
+                a.out = encodeFrame(hooks.helo);
+            }
+            if (!flush(fd, a)) { finish(fd, "send failed"); continue; }
+
+            std::string command;
+            int got;
+            bool done = false;
+            while (!done && (got = readFrame(fd, a, command)) != 0) {
+                if (got < 0) { finish(fd, "connection closed"); done = true; break; }
+                std::vector<std::string> tokens = parseCommand(command);
+                std::string kind = tokens.empty() ? "" : tokens[0];
+
+                if (a.state == AWAIT_HELO_REPLY && kind == "HELO" && tokens.size() >= 2) {
+                    a.result.responderId = tokens[1];
+                    if (!hooks.accept(a.result.responderId)) { finish(fd, "already connected"); done = true; break; }
+                    a.state = AWAIT_SERVERS;
+                    a.out = encodeFrame(hooks.buildServers());
+                    if (!flush(fd, a)) { finish(fd, "send failed"); done = true; }
+                } else if (kind == "SERVERS") {
+                    // Stop reading here; anything after belongs to the peer thread
+                    a.result.serversReply = command;
+                    finish(fd, "");
+                    done = true;
+                } else if (a.state == AWAIT_HELO_REPLY) {
+                    finish(fd, "unexpected reply: " + command.substr(0, 30));
+                    done = true;
+                }
+                // Other frames while awaiting SERVERS (KEEPALIVE, STATUSREQ...) are skipped
+            }
+            if (!done) watch(ep, fd, a);
+        }
+
+        now = monotonicMillis();
+        std::vector<int> expired;
+        for (const auto &p : active)
+            if (p.second.deadlineMs <= now) expired.push_back(p.first);
+        for (int fd : expired) finish(fd, "timed out");
+    }
+    close(ep);
+}
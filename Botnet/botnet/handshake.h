@@ -0,0 +1,61 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+/**
+ * A server to dial
+ */
+struct HandshakeTarget {
+    std::string ip;
+    int port;
+};
+
+/**
+ * Outcome of one outbound handshake
+ */
+struct HandshakeResult {
+    HandshakeTarget target;
+    int sock;                  // Connected (blocking again) socket on success, -1 on failure
+    std::string responderId;   // From their HELO; empty if they answered with SERVERS directly
+    std::string serversReply;  // Their SERVERS command
+    std::string error;         // Why the attempt failed
+    uint64_t connectMs;        // TCP connect time
+    uint64_t handshakeMs;      // Connect start until SERVERS received
+};
+
+/**
+ * Callbacks the handshake engine needs from the server
+ */
+struct HandshakeHooks {
+    std::string helo;                                           // Our HELO command
+    std::function<std::string()> buildServers;                  // Our SERVERS command, built when needed
+    std::function<bool(const std::string &responderId)> accept; // false aborts (e.g. already connected)
+    std::function<void(HandshakeResult &result)> onDone;        // Called once per target, as each finishes
+};
+
+/**
+ * Set the process-wide cap on handshakes in flight (shared by all callers)
+ */
+void setHandshakeConcurrency(int maxInFlight);
+
+/**
+ * Dial many servers at once and run the HELO/SERVERS handshake on each.
+ * Every attempt is a non-blocking state machine
+ * (connecting -> HELO sent -> awaiting SERVERS) driven by one epoll loop,
+ * so dialing a whole candidate list costs roughly one connect plus one
+ * handshake instead of the sum of all of them.
+ *
+ * Frames are read exactly, never past the SERVERS reply, so the socket can
+ * be handed straight to a blocking receiveCommand() loop.
+ *
+ * @param targets Servers to dial
+ * @param hooks Server callbacks; onDone takes ownership of result.sock
+ * @param timeoutMs Deadline for each whole attempt
+ */
+void runHandshakes(const std::vector<HandshakeTarget> &targets, const HandshakeHooks &hooks, int timeoutMs);
+
+#endif // HANDSHAKE_H
@@ -0,0 +1,409 @@
+// Load generator: a swarm of simulated peers on one epoll loop. Each peer
+// connects to a running server, does the HELO/SERVERS handshake and then
+// sends SENDMSG (to another simulated peer), KEEPALIVE, GETMSGS and STATUSREQ
+// at Poisson-distributed intervals. SENDMSG payloads carry their send time,
+// so the receiving peer measures delivery latency through the server. The
+// run ends with a JSON report on stdout (or --out=FILE); progress goes to stderr.
+#include "protocol.h"
+#include "metrics.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const int HANDSHAKE_TIMEOUT_US = 10000000;
+const int RAMP_TIMEOUT_US = 120000000;    // Give up waiting for the swarm to form
+const int DRAIN_US = 2000000;             // After the run, wait this long for in-flight messages
+const size_t MAX_OUTBUF = 1 << 20;        // Per peer; beyond it sends count as backlogged
+const char *PAYLOAD_MARK = "LG|";         // Payload: LG|<send time us>|<padding>
+
+struct Config {
+    std::string serverIp = "127.0.0.1";
+    int serverPort = 4044;
+    int peers = 1000;
+    int durationS = 10;
+    double msgRate = 1.0;        // Per peer per second
+    double keepaliveRate = 0.1;
+    double getmsgsRate = 0.2;
+    double statusRate = 0.1;
+    int payload = 64;            // SENDMSG content bytes
+    int handshakes = 16;         // Handshakes in flight while the swarm forms
+    std::string prefix = "LG";   // Simulated group ids are <prefix>_<n>
+    std::string out;
+};
+
+enum PeerState { IDLE, CONNECTING, HELO_SENT, ACTIVE, CLOSED };
+enum SendKind { SEND_SENDMSG, SEND_KEEPALIVE, SEND_GETMSGS, SEND_STATUSREQ, SEND_KINDS };
+static const char *SEND_NAMES[SEND_KINDS] = {"SENDMSG", "KEEPALIVE", "GETMSGS", "STATUSREQ"};
+
+struct SimPeer {
+    int fd = -1;
+    PeerState state = IDLE;
+    std::string groupId, in, out;
+    uint64_t startedUs = 0;
+    bool wantWrite = false;
+    std::deque<uint64_t> statusSent;  // STATUSREQs awaiting their STATUSRESP
+};
+
+struct Due {
+    uint64_t at;
+    int peer, kind;
+    bool operator>(const Due &o) const { return at > o.at; }
+};
+
+struct Totals {
+    uint64_t sent[SEND_KINDS] = {0, 0, 0, 0};
+    std::map<std::string, uint64_t> received;
+    uint64_t bytesSent = 0, bytesReceived = 0;
+    uint64_t delivered = 0, deliveredBytes = 0, lateDelivered = 0;
+    uint64_t connectFailed = 0, handshakeTimeouts = 0, disconnects = 0, frameErrors = 0, backlogged = 0;
+};
+
+static Config config;
+static std::vector<SimPeer> peers;
+static std::vector<int> activePeers;
+static int epfd;
+static Totals totals;
+static Histogram handshakeUs, deliveryUs, statusRttUs;
+static bool measuring = false;
+static uint64_t runEndUs = 0;
+
+static void setEvents(int idx) {
+    SimPeer &p = peers[idx];
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = p.wantWrite ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.u32 = idx;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, p.fd, &ev);
+}
+
+static void closePeer(int idx) {
+    SimPeer &p = peers[idx];
+    if (p.fd >= 0) close(p.fd);  // Also removes it from the epoll set
+    p.fd = -1;
+    p.state = CLOSED;
+}
+
+static void flush(int idx) {
+    SimPeer &p = peers[idx];
+    while (!p.out.empty()) {
+        ssize_t n = send(p.fd, p.out.data(), p.out.size(), MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) { totals.disconnects++; closePeer(idx); return; }
+        p.out.erase(0, n);
+    }
+    bool want = !p.out.empty();
+    if (want != p.wantWrite) { p.wantWrite = want; setEvents(idx); }
+}
+
+static bool sendTo(int idx, const std::string &cmd) {
+    SimPeer &p = peers[idx];
+    if (p.state == CLOSED) return false;
+    if (p.out.size() > MAX_OUTBUF) { totals.backlogged++; return false; }
+    std::string frame = encodeFrame(cmd);
+    p.out += frame;
+    totals.bytesSent += frame.size();
+    flush(idx);
+    return true;
+}
+
+static std::mt19937_64 rng(12345);
+
+static uint64_t nextGapUs(double ratePerS) {
+    std::exponential_distribution<double> gap(ratePerS);
+    return static_cast<uint64_t>(gap(rng) * 1e6) + 1;
+}
+
+static double rateOf(int kind) {
+    switch (kind) {
+    case SEND_SENDMSG: return config.msgRate;
+    case SEND_KEEPALIVE: return config.keepaliveRate;
+    case SEND_GETMSGS: return config.getmsgsRate;
+    default: return config.statusRate;
+    }
+}
+
+static void fire(int idx, int kind, uint64_t now) {
+    SimPeer &p = peers[idx];
+    std::string cmd;
+    if (kind == SEND_SENDMSG) {
+        if (activePeers.size() < 2) return;
+        int to = idx;
+        while (to == idx) to = activePeers[rng() % activePeers.size()];
+        std::string content = PAYLOAD_MARK + std::to_string(now) + "|";
+        if ((int)content.size() < config.payload) content.append(config.payload - content.size(), 'x');
+        cmd = buildSENDMSG(peers[to].groupId, p.groupId, content);
+    } else if (kind == SEND_KEEPALIVE) {
+        cmd = buildKEEPALIVE(0);
+    } else if (kind == SEND_GETMSGS) {
+        cmd = buildGETMSGS(p.groupId);
+    } else {
+        cmd = buildSTATUSREQ();
+    }
+    if (!sendTo(idx, cmd)) return;
+    totals.sent[kind]++;
+    if (kind == SEND_STATUSREQ) p.statusSent.push_back(now);
+}
+
+static void handleFrame(int idx, const std::string &cmd, uint64_t now) {
+    SimPeer &p = peers[idx];
+    std::string name = cmd.substr(0, cmd.find(','));
+    totals.received[name]++;
+
+    if (name == "SERVERS" && p.state == HELO_SENT) {
+        p.state = ACTIVE;
+        activePeers.push_back(idx);
+        handshakeUs.record(now - p.startedUs);
+    } else if (name == "SENDMSG") {
+        size_t mark = cmd.find(PAYLOAD_MARK);
+        if (mark == std::string::npos) return;
+        uint64_t sentUs = strtoull(cmd.c_str() + mark + strlen(PAYLOAD_MARK), NULL, 10);
+        if (sentUs == 0 || sentUs > now) return;
+        deliveryUs.record(now - sentUs);
+        totals.delivered++;
+        if (measuring) totals.deliveredBytes += cmd.size() + 5;
+        else totals.lateDelivered++;
+    } else if (name == "STATUSREQ") {
+        sendTo(idx, buildSTATUSRESP({}));
+    } else if (name == "STATUSRESP") {
+        if (!p.statusSent.empty()) {
+            statusRttUs.record(now - p.statusSent.front());
+            p.statusSent.pop_front();
+        }
+    } else if (name == "GETMSGS") {
+        sendTo(idx, "NO_MESSAGES");
+    }
+}
+
+static void readable(int idx, uint64_t now) {
+    SimPeer &p = peers[idx];
+    char buf[16384];
+    while (true) {
+        ssize_t n = recv(p.fd, buf, sizeof(buf), 0);
+        if (n > 0) { p.in.append(buf, n); totals.bytesReceived += n; continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        totals.disconnects++;
+        closePeer(idx);
+        return;
+    }
+    std::string cmd;
+    int rc;
+    while ((rc = extractFrame(p.in, cmd)) == 1) {
+        handleFrame(idx, cmd, now);
+        if (p.state == CLOSED) return;
+    }
+    if (rc < 0) { totals.frameErrors++; closePeer(idx); }
+}
+
+static bool startConnect(int idx, uint64_t now) {
+    SimPeer &p = peers[idx];
+    p.startedUs = now;
+    p.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (p.fd < 0) { totals.connectFailed++; p.state = CLOSED; return false; }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.serverPort);
+    inet_pton(AF_INET, config.serverIp.c_str(), &addr.sin_addr);
+    if (connect(p.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        totals.connectFailed++;
+        closePeer(idx);
+        return false;
+    }
+    p.state = CONNECTING;
+    p.wantWrite = true;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = idx;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, p.fd, &ev);
+    return true;
+}
+
+static void pollOnce(int timeoutMs) {
+    struct epoll_event events[256];
+    int n = epoll_wait(epfd, events, 256, timeoutMs);
+    uint64_t now = monotonicMicros();
+    for (int i = 0; i < n; i++) {
+        int idx = events[i].data.u32;
+        SimPeer &p = peers[idx];
+        if (p.state == CLOSED) continue;
+        if (p.state == CONNECTING) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) { totals.connectFailed++; closePeer(idx); continue; }
+            p.state = HELO_SENT;
+            sendTo(idx, buildHELO(p.groupId));
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) readable(idx, now);
+        if (p.state != CLOSED && (events[i].events & EPOLLOUT)) flush(idx);
+    }
+}
+
+static std::string histogramJson(const Histogram &h) {
+    std::ostringstream s;
+    s << "{\"count\": " << h.count() << ", \"mean\": " << static_cast<uint64_t>(h.mean())
+      << ", \"p50\": " << h.percentile(0.5) << ", \"p90\": " << h.percentile(0.9)
+      << ", \"p99\": " << h.percentile(0.99) << ", \"p999\": " << h.percentile(0.999)
+      << ", \"max\": " << h.max() << "}";
+    return s.str();
+}
+
+static std::string report(uint64_t formedUs, uint64_t runUs) {
+    double runS = runUs / 1e6;
+    uint64_t lost = totals.sent[SEND_SENDMSG] > totals.delivered ? totals.sent[SEND_SENDMSG] - totals.delivered : 0;
+    std::ostringstream s;
+    s << "{\n  \"config\": {\"server\": \"" << config.serverIp << ":" << config.serverPort
+      << "\", \"peers\": " << config.peers << ", \"duration_s\": " << config.durationS
+      << ", \"msg_rate\": " << config.msgRate << ", \"keepalive_rate\": " << config.keepaliveRate
+      << ", \"getmsgs_rate\": " << config.getmsgsRate << ", \"status_rate\": " << config.statusRate
+      << ", \"payload\": " << config.payload << ", \"handshakes\": " << config.handshakes << "},\n";
+    s << "  \"swarm\": {\"active\": " << activePeers.size() << ", \"connect_failed\": " << totals.connectFailed
+      << ", \"handshake_timeouts\": " << totals.handshakeTimeouts << ", \"formation_ms\": " << formedUs / 1000
+      << ", \"handshake_us\": " << histogramJson(handshakeUs) << "},\n";
+    s << "  \"run_s\": " << runS << ",\n  \"sent\": {";
+    for (int k = 0; k < SEND_KINDS; k++) s << (k ? ", " : "") << "\"" << SEND_NAMES[k] << "\": " << totals.sent[k];
+    s << "},\n  \"received\": {";
+    bool first = true;
+    for (const auto &r : totals.received) {
+        s << (first ? "" : ", ") << "\"" << r.first << "\": " << r.second;
+        first = false;
+    }
+    s << "},\n  \"forwarding\": {\"delivered\": " << totals.delivered << ", \"lost\": " << lost
+      << ", \"loss_rate\": " << (totals.sent[SEND_SENDMSG] ? (double)lost / totals.sent[SEND_SENDMSG] : 0)
+      << ", \"delivered_in_drain\": " << totals.lateDelivered
+      << ", \"msgs_per_s\": " << (runS > 0 ? (totals.delivered - totals.lateDelivered) / runS : 0)
+      << ", \"bytes_per_s\": " << (runS > 0 ? totals.deliveredBytes / runS : 0) << "},\n";
+    s << "  \"delivery_latency_us\": " << histogramJson(deliveryUs) << ",\n";
+    s << "  \"statusreq_rtt_us\": " << histogramJson(statusRttUs) << ",\n";
+    s << "  \"bytes\": {\"sent\": " << totals.bytesSent << ", \"received\": " << totals.bytesReceived << "},\n";
+    s << "  \"errors\": {\"disconnects\": " << totals.disconnects << ", \"frame_errors\": " << totals.frameErrors
+      << ", \"backlogged_sends\": " << totals.backlogged << ", \"error_rate\": "
+      << (config.peers ? (double)(totals.connectFailed + totals.handshakeTimeouts + totals.disconnects) / config.peers : 0)
+      << "}\n}\n";
+    return s.str();
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s <server_ip> <port> [--peers=N] [--duration=SEC] [--msg-rate=R] [--keepalive-rate=R]\n"
+           "       [--getmsgs-rate=R] [--status-rate=R] [--payload=BYTES] [--handshakes=N] [--prefix=ID]\n"
+           "       [--out=FILE]\n"
+           "Rates are per simulated peer per second (0 disables that command).\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) { usage(argv[0]); return 1; }
+    config.serverIp = argv[1];
+    config.serverPort = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq), val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--peers") config.peers = atoi(val.c_str());
+        else if (key == "--duration") config.durationS = atoi(val.c_str());
+        else if (key == "--msg-rate") config.msgRate = atof(val.c_str());
+        else if (key == "--keepalive-rate") config.keepaliveRate = atof(val.c_str());
+        else if (key == "--getmsgs-rate") config.getmsgsRate = atof(val.c_str());
+        else if (key == "--status-rate") config.statusRate = atof(val.c_str());
+        else if (key == "--payload") config.payload = atoi(val.c_str());
+        else if (key == "--handshakes") config.handshakes = std::max(1, atoi(val.c_str()));
+        else if (key == "--prefix") config.prefix = val;
+        else if (key == "--out") config.out = val;
+        else { usage(argv[0]); return 1; }
+    }
+
+    // One descriptor per simulated peer
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    epfd = epoll_create1(0);
+    peers.resize(config.peers);
+    for (int i = 0; i < config.peers; i++) peers[i].groupId = config.prefix + "_" + std::to_string(i + 1);
+
+    // Form the swarm a few handshakes at a time; the server accepts HELOs one by one
+    uint64_t start = monotonicMicros();
+    int next = 0, done = 0;
+    while (done < config.peers && monotonicMicros() - start < (uint64_t)RAMP_TIMEOUT_US) {
+        uint64_t now = monotonicMicros();
+        int inFlight = 0;
+        done = 0;
+        for (int i = 0; i < next; i++) {
+            SimPeer &p = peers[i];
+            if (p.state == CONNECTING || p.state == HELO_SENT) {
+                if (now - p.startedUs > (uint64_t)HANDSHAKE_TIMEOUT_US) { totals.handshakeTimeouts++; closePeer(i); done++; }
+                else inFlight++;
+            } else done++;
+        }
+        while (inFlight < config.handshakes && next < config.peers) {
+            if (startConnect(next++, now)) inFlight++;
+        }
+        pollOnce(10);
+    }
+    uint64_t formedUs = monotonicMicros() - start;
+    fprintf(stderr, "Swarm: %zu of %d peers active after %llu ms\n", activePeers.size(), config.peers,
+            (unsigned long long)(formedUs / 1000));
+
+    // Run: every active peer fires each command kind at its own Poisson rate
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due;
+    uint64_t runStart = monotonicMicros();
+    runEndUs = runStart + static_cast<uint64_t>(config.durationS) * 1000000;
+    for (int idx : activePeers)
+        for (int k = 0; k < SEND_KINDS; k++)
+            if (rateOf(k) > 0) due.push({runStart + nextGapUs(rateOf(k)), idx, k});
+    measuring = true;
+    while (true) {
+        uint64_t now = monotonicMicros();
+        if (now >= runEndUs) break;
+        while (!due.empty() && due.top().at <= now) {
+            Due d = due.top();
+            due.pop();
+            if (peers[d.peer].state != ACTIVE) continue;
+            fire(d.peer, d.kind, now);
+            due.push({now + nextGapUs(rateOf(d.kind)), d.peer, d.kind});
+        }
+        uint64_t until = due.empty() ? runEndUs : std::min(due.top().at, runEndUs);
+        pollOnce(until > now ? static_cast<int>(std::min<uint64_t>((until - now) / 1000, 10)) : 0);
+    }
+    uint64_t runUs = monotonicMicros() - runStart;
+    measuring = false;
+
+    // Drain: late deliveries still count, but not toward the throughput window
+    uint64_t drainEnd = monotonicMicros() + DRAIN_US;
+    while (monotonicMicros() < drainEnd && totals.delivered < totals.sent[SEND_SENDMSG]) pollOnce(10);
+
+    std::string json = report(formedUs, runUs);
+    if (config.out.empty()) std::cout << json;
+    else {
+        std::ofstream(config.out.c_str()) << json;
+        fprintf(stderr, "Report written to %s\n", config.out.c_str());
+    }
+    fprintf(stderr, "Delivered %llu of %llu messages, p99 %llu us\n", (unsigned long long)totals.delivered,
+            (unsigned long long)totals.sent[SEND_SENDMSG], (unsigned long long)deliveryUs.percentile(0.99));
+
+    for (int i = 0; i < config.peers; i++) if (peers[i].fd >= 0) close(peers[i].fd);
+    close(epfd);
+    return activePeers.empty() ? 1 : 0;
+}
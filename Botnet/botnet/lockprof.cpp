@@ -0,0 +1,81 @@
+#include "lockprof.h"
+#include <algorithm>
+
+bool lockProfiling = false;
+
+static std::vector<LockSite *> sites;
+static pthread_mutex_t sitesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+LockSite *lockSite(const char *file, int line) {
+    LockSite *site = new LockSite();
+    site->file = file;
+    site->line = line;
+    pthread_mutex_lock(&sitesMutex);
+    sites.push_back(site);
+    pthread_mutex_unlock(&sitesMutex);
+    return site;
+}
+
+ProfiledMutex::ProfiledMutex() : holder(nullptr), heldSince(0) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+void ProfiledMutex::lock(LockSite *site) {
+    if (!site) {
+        pthread_mutex_lock(&mutex);
+        holder = nullptr;
+        return;
+    }
+    uint64_t start = monotonicMicros();
+    pthread_mutex_lock(&mutex);
+    heldSince = monotonicMicros();
+    holder = site;
+    site->wait.record(heldSince - start);
+}
+
+void ProfiledMutex::unlock() {
+    if (holder) {
+        holder->hold.record(monotonicMicros() - heldSince);
+        holder = nullptr;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+int ProfiledMutex::timedWait(pthread_cond_t *cond, const struct timespec *deadline) {
+    LockSite *site = holder;
+    if (site) site->hold.record(monotonicMicros() - heldSince);
+    holder = nullptr;
+    int rc = pthread_cond_timedwait(cond, &mutex, deadline);
+    if (site) heldSince = monotonicMicros();
+    holder = site;
+    return rc;
+}
+
+std::vector<std::string> lockProfileLines() {
+    pthread_mutex_lock(&sitesMutex);
+    std::vector<LockSite *> hit;
+    for (LockSite *s : sites)
+        if (s->wait.count() > 0) hit.push_back(s);
+    pthread_mutex_unlock(&sitesMutex);
+
+    std::sort(hit.begin(), hit.end(), [](const LockSite *a, const LockSite *b) {
+        return a->wait.sumMicros() > b->wait.sumMicros();
+    });
+    std::vector<std::string> lines;
+    for (const LockSite *s : hit) {
+        std::string file = s->file;
+        size_t slash = file.rfind('/');
+        if (slash != std::string::npos) file = file.substr(slash + 1);
+        lines.push_back("lock{site=\"" + file + ":" + std::to_string(s->line) + "\"} n=" +
+                        std::to_string(s->wait.count()) +
+                        " wait_p50_us=" + std::to_string(s->wait.percentile(0.5)) +
+                        " wait_p99_us=" + std::to_string(s->wait.percentile(0.99)) +
+                        " wait_max_us=" + std::to_string(s->wait.max()) +
+                        " wait_total_us=" + std::to_string(s->wait.sumMicros()) +
+                        " hold_p50_us=" + std::to_string(s->hold.percentile(0.5)) +
+                        " hold_p99_us=" + std::to_string(s->hold.percentile(0.99)) +
+                        " hold_max_us=" + std::to_string(s->hold.max()) +
+                        " hold_total_us=" + std::to_string(s->hold.sumMicros()));
+    }
+    return lines;
+}
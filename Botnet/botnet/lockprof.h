@@ -0,0 +1,69 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include "metrics.h"
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+/**
+ * One place a profiled mutex is taken (file:line), with how long callers
+ * waited for the mutex there and how long they then held it
+ */
+struct LockSite {
+    const char *file;
+    int line;
+    Histogram wait, hold;
+};
+
+/**
+ * Profiling switch (--lock-profile). Set it before any thread starts:
+ * each call site decides once, the first time it runs, whether it is profiled.
+ */
+extern bool lockProfiling;
+
+/**
+ * Register a call site; used by PROFILED_LOCK
+ */
+LockSite *lockSite(const char *file, int line);
+
+/**
+ * pthread mutex that records wait and hold time per call site when the
+ * site has a LockSite. Unprofiled sites cost one branch over a raw mutex.
+ */
+class ProfiledMutex {
+public:
+    ProfiledMutex();
+
+    void lock(LockSite *site);
+    void unlock();
+
+    /**
+     * pthread_cond_timedwait on this mutex. Time asleep counts as neither
+     * wait nor hold; the hold restarts once the mutex is retaken.
+     */
+    int timedWait(pthread_cond_t *cond, const struct timespec *deadline);
+
+private:
+    pthread_mutex_t mutex;
+    LockSite *holder;    // Site of the current hold; only the holder touches these
+    uint64_t heldSince;
+};
+
+/**
+ * Take m, attributing the wait and hold to this file:line
+ */
+#define PROFILED_LOCK(m) do { \
+    static LockSite *lockSite_ = lockProfiling ? lockSite(__FILE__, __LINE__) : nullptr; \
+    (m).lock(lockSite_); \
+} while (0)
+
+#define PROFILED_UNLOCK(m) (m).unlock()
+
+/**
+ * One line per call site that has been hit, the most total wait first:
+ * count, wait and hold p50/p99/max and totals
+ */
+std::vector<std::string> lockProfileLines();
+
+#endif // LOCKPROF_H
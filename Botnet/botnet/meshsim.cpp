@@ -0,0 +1,595 @@
+// Local multi-node harness: launches M servers on loopback with distinct
+// group ids (--group, --offline), wired as a line, ring or random graph
+// through their initial peer lists. It measures how long the mesh takes to
+// form, then injects SENDMSGs one at a time between random node pairs and
+// reports, per delivered message, how many frames the whole mesh sent
+// (flood amplification), how many copies arrived and over how many hops,
+// next to the topology's shortest path.
+//
+// --mode=chain benchmarks forwarding latency instead: the nodes form a line,
+// a probe peer on the first node sends timestamped SENDMSGs to a sink peer
+// on the last, and a tap peer on every other node receives the copy that
+// node floods onward, so each hop's latency is the gap between consecutive
+// arrivals. One thread does all the reading, stamping each read as it
+// returns from poll(); the background load (every node relaying a steady
+// stream of messages between its tap and itself) is sent from a second
+// thread so it does not delay the stamps.
+//
+// The report is JSON on stdout (or --out=FILE); progress goes to stderr.
+#include "protocol.h"
+#include "metrics.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Config {
+    std::string server = "./tsamgroup1";
+    std::string workdir = "meshsim_run";
+    std::string mode = "flood";   // flood | chain
+    std::string topology = "ring";
+    int nodes = 8;
+    double degree = 3;     // Mean degree of the random graph
+    int basePort = 47000;
+    int messages = 20;
+    int settleMs = 300;    // The mesh is quiet once no node sent a frame for this long
+    int timeoutS = 30;     // Per phase: formation, and each message's delivery
+    unsigned seed = 1;
+    std::string out;
+    // Chain mode
+    int probes = 200;
+    int probeIntervalMs = 10;
+    std::vector<int> loads = {0, 500, 2000};  // Background messages per second per node
+};
+
+struct Node {
+    std::string groupId;
+    int port;
+    pid_t pid;
+    std::set<int> neighbors;
+    uint64_t harnessFrames;  // Frames this node has sent to the harness itself
+};
+
+// One STATS reply: plain "name value" lines, plus the delivered_hops breakdown
+struct NodeStats {
+    bool ok;
+    std::map<std::string, uint64_t> values;
+    std::map<int, uint64_t> hops;
+};
+
+static Config config;
+static std::vector<Node> nodes;
+
+static uint64_t nowMs() {
+    return monotonicMicros() / 1000;
+}
+
+static int connectTo(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    struct timeval tv = {2, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) { close(sock); return -1; }
+    return sock;
+}
+
+// Every frame a node sends counts in its frames_sent_total, the harness's own replies included
+static bool request(int idx, const std::string &cmd, const std::string &endsWith, std::vector<std::string> &replies) {
+    int sock = connectTo(nodes[idx].port);
+    if (sock < 0) return false;
+    bool ok = sendCommand(sock, cmd);
+    std::string reply;
+    while (ok && (ok = receiveCommand(sock, reply))) {
+        nodes[idx].harnessFrames++;
+        replies.push_back(reply);
+        if (endsWith.empty() || reply == endsWith) break;
+    }
+    close(sock);
+    return ok;
+}
+
+static NodeStats queryStats(int idx) {
+    NodeStats stats;
+    std::vector<std::string> replies;
+    stats.ok = request(idx, "STATS", "STATS_END", replies);
+    for (const auto &reply : replies) {
+        std::istringstream in(reply);
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t space = line.rfind(' ');
+            if (space == std::string::npos) continue;
+            std::string name = line.substr(0, space);
+            uint64_t value = strtoull(line.c_str() + space + 1, NULL, 10);
+            if (name.compare(0, 21, "delivered_hops{hops=\"") == 0) stats.hops[atoi(name.c_str() + 21)] = value;
+            else if (name.find(' ') == std::string::npos) stats.values[name] = value;
+        }
+    }
+    return stats;
+}
+
+static void buildTopology(std::mt19937 &rng) {
+    int n = config.nodes;
+    auto link = [](int a, int b) {
+        if (a == b) return;
+        nodes[a].neighbors.insert(b);
+        nodes[b].neighbors.insert(a);
+    };
+    for (int i = 0; i + 1 < n; i++) {
+        // A random spanning tree keeps the random graph connected
+        if (config.topology == "random") link(i + 1, std::uniform_int_distribution<int>(0, i)(rng));
+        else link(i, i + 1);
+    }
+    if (config.topology == "ring" && n > 2) link(n - 1, 0);
+    if (config.topology == "random") {
+        double extra = std::max(0.0, config.degree * n / 2 - (n - 1));
+        std::uniform_int_distribution<int> pick(0, n - 1);
+        for (int tries = 0; extra >= 1 && tries < n * n; tries++) {
+            int a = pick(rng), b = pick(rng);
+            if (a == b || nodes[a].neighbors.count(b)) continue;
+            link(a, b);
+            extra--;
+        }
+    }
+}
+
+static std::vector<int> distancesFrom(int src) {
+    std::vector<int> dist(nodes.size(), -1);
+    std::queue<int> q;
+    dist[src] = 0;
+    q.push(src);
+    while (!q.empty()) {
+        int u = q.front();
+        q.pop();
+        for (int v : nodes[u].neighbors)
+            if (dist[v] < 0) { dist[v] = dist[u] + 1; q.push(v); }
+    }
+    return dist;
+}
+
+// Node i dials its lower-numbered neighbors, which are already listening
+static pid_t launch(int idx) {
+    std::vector<std::string> args = {config.server, std::to_string(nodes[idx].port), "--group=" + nodes[idx].groupId,
+                                     "--offline", "--no-snapshot", "--min-peers=0", "--students=0",
+                                     "--instructors=0", "--max-peers=64"};
+    for (int j : nodes[idx].neighbors)
+        if (j < idx) args.push_back("127.0.0.1:" + std::to_string(nodes[j].port));
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    if (chdir(config.workdir.c_str()) != 0) _exit(127);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    dup2(devnull, 2);
+    std::vector<char *> argv;
+    for (auto &a : args) argv.push_back(&a[0]);
+    argv.push_back(NULL);
+    execv(argv[0], argv.data());
+    _exit(127);
+}
+
+static bool waitListening(int idx) {
+    for (uint64_t deadline = nowMs() + config.timeoutS * 1000; nowMs() < deadline; usleep(20000)) {
+        int sock = connectTo(nodes[idx].port);
+        if (sock >= 0) { close(sock); return true; }
+    }
+    return false;
+}
+
+static void stopAll() {
+    for (const auto &n : nodes) if (n.pid > 0) kill(n.pid, SIGTERM);
+    for (const auto &n : nodes) if (n.pid > 0) waitpid(n.pid, NULL, 0);
+}
+
+static std::string mapJson(const std::map<int, uint64_t> &m) {
+    std::ostringstream s;
+    s << "{";
+    bool first = true;
+    for (const auto &e : m) { s << (first ? "" : ", ") << "\"" << e.first << "\": " << e.second; first = false; }
+    s << "}";
+    return s.str();
+}
+
+// Chain mode ---------------------------------------------------------------
+
+const char *PROBE_MARK = "CB|";  // Probe content: CB|p|<id>|<send time>, background: CB|b|<n>
+
+struct ChainPeer {
+    std::string groupId;
+    int fd;
+    std::string in;
+};
+
+// Register a simulated peer with a node
+static bool attachPeer(int node, ChainPeer &peer) {
+    peer.fd = connectTo(nodes[node].port);
+    if (peer.fd < 0) return false;
+    std::string reply;
+    if (!sendCommand(peer.fd, buildHELO(peer.groupId)) || !receiveCommand(peer.fd, reply) ||
+        reply.compare(0, 7, "SERVERS") != 0) {
+        close(peer.fd);
+        return false;
+    }
+    fcntl(peer.fd, F_SETFL, fcntl(peer.fd, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+// Whole-frame send on a non-blocking socket; the reader thread may be reading it meanwhile
+static void sendAll(int fd, const std::string &frame) {
+    size_t sent = 0;
+    while (sent < frame.size()) {
+        ssize_t n = send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+        if (n > 0) { sent += n; continue; }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return;
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        poll(&pfd, 1, 10);
+    }
+}
+
+// Reads everything pending and hands each complete frame over with the time it was read
+template <typename Handler>
+static void readPeer(ChainPeer &peer, Handler handle) {
+    char buf[16384];
+    while (true) {
+        ssize_t n = recv(peer.fd, buf, sizeof(buf), 0);
+        if (n <= 0) return;
+        uint64_t stamp = monotonicMicros();
+        peer.in.append(buf, n);
+        std::string cmd;
+        while (extractFrame(peer.in, cmd) == 1) handle(cmd, stamp);
+    }
+}
+
+struct BackgroundLoad {
+    std::vector<ChainPeer *> peers;  // One per node
+    int perNodeRate;
+    std::atomic<bool> stop;
+    std::atomic<uint64_t> sent;
+};
+
+// Each node relays perNodeRate messages a second from its background peer back to it
+static void *backgroundThread(void *arg) {
+    BackgroundLoad *load = (BackgroundLoad *)arg;
+    size_t n = load->peers.size();
+    uint64_t gap = 1000000 / load->perNodeRate, start = monotonicMicros();
+    std::vector<uint64_t> next(n);
+    for (size_t k = 0; k < n; k++) next[k] = start + gap * k / n;
+    while (!load->stop) {
+        uint64_t now = monotonicMicros();
+        for (size_t k = 0; k < n; k++) {
+            for (; next[k] <= now; next[k] += gap) {
+                ChainPeer *b = load->peers[k];
+                // Numbered so no two background messages are identical
+                std::string content = "CB|b|" + std::to_string(load->sent++);
+                sendAll(b->fd, encodeFrame(buildSENDMSG(b->groupId, b->groupId, content)));
+            }
+        }
+        usleep(200);
+    }
+    return NULL;
+}
+
+static std::string histogramJson(const Histogram &h) {
+    std::ostringstream s;
+    s << "{\"count\": " << h.count() << ", \"mean\": " << static_cast<uint64_t>(h.mean())
+      << ", \"p50\": " << h.percentile(0.5) << ", \"p90\": " << h.percentile(0.9)
+      << ", \"p99\": " << h.percentile(0.99) << ", \"max\": " << h.max() << "}";
+    return s.str();
+}
+
+// Node k's onward copy reaches tap k (the sink for the last node), so
+// arrival[k] - arrival[k-1] is hop k and arrival[n-1] - send is end to end
+static std::string runChain() {
+    int n = config.nodes;
+    ChainPeer source = {"CB_SRC", -1, ""}, sink = {"CB_SINK", -1, ""};
+    std::vector<ChainPeer> taps;
+    for (int k = 0; k + 1 < n; k++) taps.push_back({"CB_TAP_" + std::to_string(k + 1), -1, ""});
+    bool ok = attachPeer(0, source) && attachPeer(n - 1, sink);
+    for (int k = 0; ok && k + 1 < n; k++) ok = attachPeer(k, taps[k]);
+    if (!ok) return "";
+    usleep(200000);  // Let each node finish registering its new peers
+
+    // Background traffic on node k goes from its tap (the sink on the last node) back to itself
+    BackgroundLoad background;
+    for (int k = 0; k < n; k++) background.peers.push_back(k + 1 < n ? &taps[k] : &sink);
+    std::vector<ChainPeer *> readers = {&source, &sink};
+    for (auto &t : taps) readers.push_back(&t);
+
+    std::ostringstream levels;
+    for (size_t level = 0; level < config.loads.size(); level++) {
+        int load = config.loads[level];
+        std::vector<std::unique_ptr<Histogram>> perHop;
+        for (int k = 0; k < n; k++) perHop.emplace_back(new Histogram());
+        Histogram endToEnd, allHops;
+        std::vector<uint64_t> sentAt(config.probes, 0);
+        std::vector<std::vector<uint64_t>> arrival(config.probes, std::vector<uint64_t>(n, 0));
+        uint64_t backgroundDelivered = 0, probesDelivered = 0;
+
+        auto handler = [&](int position) {
+            return [&, position](const std::string &cmd, uint64_t stamp) {
+                size_t mark = cmd.find(PROBE_MARK);
+                if (cmd.compare(0, 7, "SENDMSG") != 0 || mark == std::string::npos) return;
+                const char *p = cmd.c_str() + mark + strlen(PROBE_MARK);
+                if (*p == 'b') { backgroundDelivered++; return; }
+                int id = atoi(p + 2);
+                if (position < 0 || id < 0 || id >= config.probes || arrival[id][position]) return;
+                arrival[id][position] = stamp;
+                if (position == n - 1) probesDelivered++;
+            };
+        };
+
+        background.perNodeRate = load;
+        background.stop = false;
+        background.sent = 0;
+        pthread_t bgThread;
+        bool bgRunning = load > 0 && pthread_create(&bgThread, NULL, backgroundThread, &background) == 0;
+
+        uint64_t start = monotonicMicros();
+        uint64_t probeGap = config.probeIntervalMs * 1000ULL, nextProbe = start + 200000;  // Background warms up first
+        int sent = 0;
+        uint64_t deadline = 0;
+        while (true) {
+            uint64_t now = monotonicMicros();
+            if (sent == config.probes && (probesDelivered == (uint64_t)config.probes || now > deadline)) break;
+            if (sent < config.probes && now >= nextProbe) {
+                std::string frame = encodeFrame(buildSENDMSG(sink.groupId, source.groupId,
+                                                             "CB|p|" + std::to_string(sent) + "|" + std::to_string(now)));
+                uint64_t stamp = monotonicMicros();
+                sendAll(source.fd, frame);
+                sentAt[sent++] = stamp;
+                nextProbe += probeGap;
+                if (sent == config.probes) deadline = now + config.timeoutS * 1000000ULL;
+            }
+
+            std::vector<struct pollfd> fds;
+            for (ChainPeer *r : readers) fds.push_back({r->fd, POLLIN, 0});
+            uint64_t wait = sent < config.probes && nextProbe > now ? (nextProbe - now) / 1000 : 1;
+            poll(fds.data(), fds.size(), static_cast<int>(std::min<uint64_t>(wait, 1)));
+            for (size_t i = 0; i < readers.size(); i++) {
+                if (!(fds[i].revents & POLLIN)) continue;
+                // readers: source, sink, then tap 0..n-2
+                int position = i == 1 ? n - 1 : i >= 2 ? (int)i - 2 : -1;
+                readPeer(*readers[i], handler(position));
+            }
+        }
+        double seconds = (monotonicMicros() - start) / 1e6;
+        background.stop = true;
+        if (bgRunning) pthread_join(bgThread, NULL);
+
+        for (int id = 0; id < config.probes; id++) {
+            if (!arrival[id][n - 1]) continue;
+            endToEnd.record(arrival[id][n - 1] - std::min(sentAt[id], arrival[id][n - 1]));
+            uint64_t prev = sentAt[id];
+            for (int k = 0; k < n; k++) {
+                if (!arrival[id][k]) { prev = 0; continue; }
+                if (prev) {
+                    uint64_t hop = arrival[id][k] > prev ? arrival[id][k] - prev : 0;
+                    perHop[k]->record(hop);
+                    allHops.record(hop);
+                }
+                prev = arrival[id][k];
+            }
+        }
+        fprintf(stderr, "load %d/s per node: %llu of %d probes, end to end p50 %llu us p99 %llu us, per hop p50 %llu us\n",
+                load, (unsigned long long)probesDelivered, config.probes, (unsigned long long)endToEnd.percentile(0.5),
+                (unsigned long long)endToEnd.percentile(0.99), (unsigned long long)allHops.percentile(0.5));
+
+        levels << (level ? ",\n" : "\n") << "    {\"load_per_node\": " << load << ", \"probes\": " << config.probes
+               << ", \"delivered\": " << probesDelivered << ", \"background_sent\": " << background.sent
+               << ", \"background_delivered_per_s\": " << (seconds > 0 ? backgroundDelivered / seconds : 0)
+               << ",\n     \"end_to_end_us\": " << histogramJson(endToEnd)
+               << ",\n     \"hop_us\": " << histogramJson(allHops) << ",\n     \"per_hop_us\": [";
+        for (int k = 0; k < n; k++) levels << (k ? ",\n       " : "\n       ") << histogramJson(*perHop[k]);
+        levels << "]}";
+    }
+    for (ChainPeer *r : readers) close(r->fd);
+    return levels.str();
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [--mode=flood|chain] [--nodes=M] [--topology=line|ring|random] [--degree=D] [--messages=N]\n"
+           "       [--seed=S] [--base-port=P] [--server=PATH] [--workdir=DIR] [--settle-ms=MS] [--timeout=SEC]\n"
+           "       [--probes=N] [--probe-interval-ms=MS] [--loads=L1,L2,...] [--out=FILE]\n"
+           "Chain mode always uses a line; --loads are background messages per second per node.\n",
+           prog);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq), val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--nodes") config.nodes = std::max(2, atoi(val.c_str()));
+        else if (key == "--topology") config.topology = val;
+        else if (key == "--degree") config.degree = atof(val.c_str());
+        else if (key == "--messages") config.messages = atoi(val.c_str());
+        else if (key == "--seed") config.seed = atoi(val.c_str());
+        else if (key == "--base-port") config.basePort = atoi(val.c_str());
+        else if (key == "--server") config.server = val;
+        else if (key == "--workdir") config.workdir = val;
+        else if (key == "--settle-ms") config.settleMs = atoi(val.c_str());
+        else if (key == "--timeout") config.timeoutS = atoi(val.c_str());
+        else if (key == "--out") config.out = val;
+        else if (key == "--mode") config.mode = val;
+        else if (key == "--probes") config.probes = std::max(1, atoi(val.c_str()));
+        else if (key == "--probe-interval-ms") config.probeIntervalMs = std::max(1, atoi(val.c_str()));
+        else if (key == "--loads") {
+            config.loads.clear();
+            std::istringstream in(val);
+            std::string load;
+            while (std::getline(in, load, ',')) config.loads.push_back(atoi(load.c_str()));
+        }
+        else { usage(argv[0]); return 1; }
+    }
+    if (config.mode == "chain") config.topology = "line";
+    if ((config.mode != "flood" && config.mode != "chain") ||
+        (config.topology != "line" && config.topology != "ring" && config.topology != "random")) { usage(argv[0]); return 1; }
+    if (config.server.find('/') != std::string::npos && config.server[0] != '/') {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd))) config.server = std::string(cwd) + "/" + config.server;
+    }
+    std::string mkdir = "mkdir -p '" + config.workdir + "'";
+    if (system(mkdir.c_str()) != 0) { fprintf(stderr, "Cannot create %s\n", config.workdir.c_str()); return 1; }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::mt19937 rng(config.seed);
+    for (int i = 0; i < config.nodes; i++)
+        nodes.push_back({"N_" + std::to_string(i + 1), config.basePort + i, 0, std::set<int>(), 0});
+    buildTopology(rng);
+    size_t edges = 0;
+    for (const auto &n : nodes) edges += n.neighbors.size();
+    edges /= 2;
+
+    // Formation: from the first launch until every node has its topology degree
+    uint64_t start = nowMs();
+    for (int i = 0; i < config.nodes; i++) {
+        nodes[i].pid = launch(i);
+        if (nodes[i].pid < 0 || !waitListening(i)) {
+            fprintf(stderr, "Node %s did not start\n", nodes[i].groupId.c_str());
+            stopAll();
+            return 1;
+        }
+    }
+    uint64_t launchedMs = nowMs() - start;
+    bool formed = false;
+    while (!formed && nowMs() - start < (uint64_t)config.timeoutS * 1000) {
+        formed = true;
+        for (int i = 0; i < config.nodes && formed; i++)
+            formed = queryStats(i).values["connected_peers"] >= nodes[i].neighbors.size();
+        if (!formed) usleep(20000);
+    }
+    uint64_t formationMs = nowMs() - start;
+    fprintf(stderr, "Mesh: %d nodes, %zu edges (%s), %s after %llu ms\n", config.nodes, edges,
+            config.topology.c_str(), formed ? "formed" : "NOT formed", (unsigned long long)formationMs);
+
+    if (config.mode == "chain") {
+        std::string levels = formed ? runChain() : "";
+        stopAll();
+        if (levels.empty()) { fprintf(stderr, "Chain benchmark did not run\n"); return 1; }
+        std::ostringstream s;
+        s << "{\n  \"config\": {\"mode\": \"chain\", \"nodes\": " << config.nodes << ", \"probes\": " << config.probes
+          << ", \"probe_interval_ms\": " << config.probeIntervalMs << "},\n  \"formation_ms\": " << formationMs
+          << ",\n  \"levels\": [" << levels << "\n  ]\n}\n";
+        if (config.out.empty()) std::cout << s.str();
+        else std::ofstream(config.out.c_str()) << s.str();
+        return 0;
+    }
+
+    // Traffic: one message at a time so every frame in the window belongs to it
+    Histogram latencyUs;
+    std::vector<uint64_t> framesPerMessage;
+    std::map<int, uint64_t> hopCounts, shortest;
+    uint64_t delivered = 0, copies = 0, lost = 0;
+    std::uniform_int_distribution<int> pick(0, config.nodes - 1);
+    for (int m = 0; formed && m < config.messages; m++) {
+        int src = pick(rng), dst = pick(rng);
+        while (dst == src) dst = pick(rng);
+
+        std::vector<NodeStats> before;
+        std::vector<uint64_t> harnessBefore;
+        for (int i = 0; i < config.nodes; i++) {
+            harnessBefore.push_back(nodes[i].harnessFrames);
+            before.push_back(queryStats(i));
+        }
+        uint64_t received0 = before[dst].values["messages_received_total"];
+
+        uint64_t sentUs = monotonicMicros();
+        std::vector<std::string> reply;
+        request(src, "SENDMSG," + nodes[dst].groupId + ",meshsim " + std::to_string(m), "", reply);
+
+        bool arrived = false;
+        uint64_t deadline = nowMs() + config.timeoutS * 1000;
+        while (!arrived && nowMs() < deadline) {
+            arrived = queryStats(dst).values["messages_received_total"] > received0;
+            if (arrived) latencyUs.record(monotonicMicros() - sentUs);
+            else usleep(2000);
+        }
+        if (!arrived) { lost++; continue; }
+        delivered++;
+        shortest[distancesFrom(src)[dst]]++;
+
+        // Let the flood die out: wait until the mesh-wide frame count stops moving
+        std::vector<NodeStats> after;
+        std::vector<uint64_t> harnessAfter;
+        uint64_t lastTotal = 0, stableSince = nowMs();
+        while (true) {
+            after.clear();
+            harnessAfter.clear();
+            uint64_t total = 0;
+            for (int i = 0; i < config.nodes; i++) {
+                harnessAfter.push_back(nodes[i].harnessFrames);
+                after.push_back(queryStats(i));
+                total += after[i].values["frames_sent_total"] - (harnessAfter[i] - harnessBefore[i]);
+            }
+            if (total != lastTotal) { lastTotal = total; stableSince = nowMs(); }
+            else if (nowMs() - stableSince >= (uint64_t)config.settleMs) break;
+            if (nowMs() > deadline) break;
+            usleep(config.settleMs * 1000 / 4);
+        }
+
+        // Frames the nodes sent each other; replies to the harness are taken out
+        uint64_t frames = 0;
+        for (int i = 0; i < config.nodes; i++)
+            frames += after[i].values["frames_sent_total"] - before[i].values["frames_sent_total"] -
+                      (harnessAfter[i] - harnessBefore[i]);
+        framesPerMessage.push_back(frames);
+        for (const auto &h : after[dst].hops) {
+            uint64_t n = h.second - (before[dst].hops.count(h.first) ? before[dst].hops[h.first] : 0);
+            if (n > 0) { hopCounts[h.first] += n; copies += n; }
+        }
+        fprintf(stderr, "msg %d: %s -> %s, %llu frames, shortest path %d\n", m, nodes[src].groupId.c_str(),
+                nodes[dst].groupId.c_str(), (unsigned long long)frames, distancesFrom(src)[dst]);
+    }
+    stopAll();
+
+    std::sort(framesPerMessage.begin(), framesPerMessage.end());
+    uint64_t frameSum = 0;
+    for (uint64_t f : framesPerMessage) frameSum += f;
+    std::ostringstream s;
+    s << "{\n  \"config\": {\"nodes\": " << config.nodes << ", \"topology\": \"" << config.topology
+      << "\", \"edges\": " << edges << ", \"messages\": " << config.messages << ", \"seed\": " << config.seed << "},\n";
+    s << "  \"formation\": {\"formed\": " << (formed ? "true" : "false") << ", \"launch_ms\": " << launchedMs
+      << ", \"formation_ms\": " << formationMs << "},\n";
+    s << "  \"delivery\": {\"delivered\": " << delivered << ", \"lost\": " << lost << ", \"copies\": " << copies
+      << ", \"duplicates_per_message\": " << (delivered ? (double)(copies - delivered) / delivered : 0)
+      << ", \"latency_us\": {\"p50\": " << latencyUs.percentile(0.5) << ", \"p99\": " << latencyUs.percentile(0.99)
+      << ", \"max\": " << latencyUs.max() << "}},\n";
+    s << "  \"amplification\": {\"frames_per_message_mean\": "
+      << (framesPerMessage.empty() ? 0 : (double)frameSum / framesPerMessage.size())
+      << ", \"p50\": " << (framesPerMessage.empty() ? 0 : framesPerMessage[framesPerMessage.size() / 2])
+      << ", \"max\": " << (framesPerMessage.empty() ? 0 : framesPerMessage.back())
+      << ", \"edges\": " << edges << "},\n";
+    s << "  \"hops\": " << mapJson(hopCounts) << ",\n";
+    s << "  \"shortest_path\": " << mapJson(shortest) << "\n}\n";
+    if (config.out.empty()) std::cout << s.str();
+    else {
+        std::ofstream(config.out.c_str()) << s.str();
+        fprintf(stderr, "Report written to %s\n", config.out.c_str());
+    }
+    return formed && lost == 0 ? 0 : 1;
+}
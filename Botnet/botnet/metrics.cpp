@@ -0,0 +1,236 @@
+#include "metrics.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <time.h>
+
+enum MetricType { COUNTER, GAUGE, GAUGE_FN, HISTOGRAM };
+
+struct Registered {
+    MetricType type;
+    std::string name, help;
+    const void *metric;
+};
+
+// Function-local so metrics defined as globals in other files can register safely
+static std::vector<Registered> &registry() {
+    static std::vector<Registered> metrics;
+    return metrics;
+}
+static pthread_mutex_t registryMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void registerMetric(MetricType type, const std::string &name, const std::string &help, const void *metric) {
+    pthread_mutex_lock(&registryMutex);
+    registry().push_back({type, name, help, metric});
+    pthread_mutex_unlock(&registryMutex);
+}
+
+// Threads take shards round robin the first time they touch a metric
+static int threadShard() {
+    static std::atomic<unsigned> nextShard(0);
+    thread_local int shard = nextShard.fetch_add(1) % METRIC_SHARDS;
+    return shard;
+}
+
+uint64_t monotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+Counter::Counter(const std::string &name, const std::string &help) {
+    for (auto &s : shards) s.v.store(0);
+    registerMetric(COUNTER, name, help, this);
+}
+
+void Counter::add(uint64_t n) {
+    shards[threadShard()].v.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const auto &s : shards) total += s.v.load(std::memory_order_relaxed);
+    return total;
+}
+
+Gauge::Gauge(const std::string &name, const std::string &help) {
+    for (auto &s : shards) s.v.store(0);
+    registerMetric(GAUGE, name, help, this);
+}
+
+void Gauge::add(int64_t n) {
+    shards[threadShard()].v.fetch_add(n, std::memory_order_relaxed);
+}
+
+int64_t Gauge::value() const {
+    int64_t total = 0;
+    for (const auto &s : shards) total += s.v.load(std::memory_order_relaxed);
+    return total;
+}
+
+GaugeFn::GaugeFn(const std::string &name, const std::string &help, std::function<int64_t()> fn) : fn(fn) {
+    registerMetric(GAUGE_FN, name, help, this);
+}
+
+Histogram::Histogram() {
+    for (auto &b : buckets) b.store(0);
+    total.store(0);
+    sum.store(0);
+    maxSeen.store(0);
+}
+
+Histogram::Histogram(const std::string &name, const std::string &help) : Histogram() {
+    registerMetric(HISTOGRAM, name, help, this);
+}
+
+// Values below SUB get a bucket each; above, SUB buckets per power of two
+int Histogram::bucketFor(uint64_t us) {
+    if (us < static_cast<uint64_t>(SUB)) return static_cast<int>(us);
+    int exp = 63 - __builtin_clzll(us);
+    if (exp >= MAX_EXP) return BUCKETS - 1;
+    int sub = static_cast<int>(us >> (exp - SUB_BITS)) - SUB;
+    return SUB + (exp - SUB_BITS) * SUB + sub;
+}
+
+uint64_t Histogram::bucketHigh(int index) {
+    if (index < SUB) return index;
+    int exp = (index - SUB) / SUB + SUB_BITS;
+    int sub = (index - SUB) % SUB;
+    uint64_t width = 1ULL << (exp - SUB_BITS);
+    return static_cast<uint64_t>(SUB + sub) * width + width - 1;
+}
+
+void Histogram::record(uint64_t us) {
+    buckets[bucketFor(us)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(us, std::memory_order_relaxed);
+    uint64_t seen = maxSeen.load(std::memory_order_relaxed);
+    while (us > seen && !maxSeen.compare_exchange_weak(seen, us, std::memory_order_relaxed)) {}
+}
+
+uint64_t Histogram::count() const {
+    return total.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sumMicros() const {
+    return sum.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::max() const {
+    return maxSeen.load(std::memory_order_relaxed);
+}
+
+double Histogram::mean() const {
+    uint64_t n = count();
+    return n ? static_cast<double>(sumMicros()) / n : 0;
+}
+
+uint64_t Histogram::percentile(double q) const {
+    uint64_t counts[BUCKETS], n = 0;
+    for (int i = 0; i < BUCKETS; i++) n += counts[i] = buckets[i].load(std::memory_order_relaxed);
+    if (n == 0) return 0;
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * n)));
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) return std::min(bucketHigh(i), max());
+    }
+    return max();
+}
+
+std::vector<std::string> renderMetrics() {
+    pthread_mutex_lock(&registryMutex);
+    std::vector<Registered> metrics = registry();
+    pthread_mutex_unlock(&registryMutex);
+
+    static const char *TYPES[] = {"counter", "gauge", "gauge", "summary"};
+    std::vector<std::string> lines;
+    for (const auto &m : metrics) {
+        lines.push_back("# HELP " + m.name + " " + m.help);
+        lines.push_back("# TYPE " + m.name + " " + TYPES[m.type]);
+        switch (m.type) {
+        case COUNTER:
+            lines.push_back(m.name + " " + std::to_string(static_cast<const Counter *>(m.metric)->value()));
+            break;
+        case GAUGE:
+            lines.push_back(m.name + " " + std::to_string(static_cast<const Gauge *>(m.metric)->value()));
+            break;
+        case GAUGE_FN:
+            lines.push_back(m.name + " " + std::to_string(static_cast<const GaugeFn *>(m.metric)->value()));
+            break;
+        case HISTOGRAM: {
+            const Histogram *h = static_cast<const Histogram *>(m.metric);
+            static const char *QUANTILES[] = {"0.5", "0.9", "0.99"};
+            for (const char *q : QUANTILES)
+                lines.push_back(m.name + "{quantile=\"" + q + "\"} " + std::to_string(h->percentile(atof(q))));
+            lines.push_back(m.name + "_count " + std::to_string(h->count()));
+            lines.push_back(m.name + "_sum " + std::to_string(h->sumMicros()));
+            lines.push_back(m.name + "_max " + std::to_string(h->max()));
+            break;
+        }
+        }
+    }
+    return lines;
+}
+
+static void *metricsServerThread(void *arg) {
+    int listenSock = *(int *)arg;
+    delete (int *)arg;
+    while (true) {
+        int sock = accept(listenSock, NULL, NULL);
+        if (sock < 0) continue;
+
+        // Give an HTTP client a moment to send its request line
+        char req[1024];
+        ssize_t n = 0;
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, 200) > 0) n = recv(sock, req, sizeof(req), 0);
+
+        std::string body;
+        for (const auto &line : renderMetrics()) body += line + "\n";
+        std::string reply = body;
+        if (n >= 4 && strncmp(req, "GET ", 4) == 0)
+            reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    std::to_string(body.size()) + "\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < reply.size()) {
+            ssize_t w = send(sock, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (w <= 0) break;
+            sent += w;
+        }
+        close(sock);
+    }
+    return NULL;
+}
+
+bool startMetricsServer(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+    int set = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &set, sizeof(set));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+        close(sock);
+        return false;
+    }
+    pthread_t tid;
+    int *arg = new int(sock);
+    if (pthread_create(&tid, NULL, metricsServerThread, arg) != 0) {
+        delete arg;
+        close(sock);
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
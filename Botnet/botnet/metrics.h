@@ -0,0 +1,124 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+const int METRIC_SHARDS = 16;
+
+/**
+ * Monotonically increasing count. Each thread adds to its own cache-line
+ * sized shard with a relaxed atomic, so hot paths never contend or lock;
+ * value() sums the shards.
+ *
+ * Metrics register themselves on construction and must live for the
+ * whole run (define them as globals).
+ */
+class Counter {
+public:
+    Counter(const std::string &name, const std::string &help);
+    void add(uint64_t n = 1);
+    uint64_t value() const;
+
+private:
+    struct alignas(64) Shard { std::atomic<uint64_t> v; };
+    Shard shards[METRIC_SHARDS];
+};
+
+/**
+ * Value that goes up and down (e.g. queued messages), sharded like Counter
+ */
+class Gauge {
+public:
+    Gauge(const std::string &name, const std::string &help);
+    void add(int64_t n);
+    void sub(int64_t n) { add(-n); }
+    int64_t value() const;
+
+private:
+    struct alignas(64) Shard { std::atomic<int64_t> v; };
+    Shard shards[METRIC_SHARDS];
+};
+
+/**
+ * Gauge whose value is computed when metrics are rendered, for state
+ * that already lives elsewhere (peer count, pending timers)
+ */
+class GaugeFn {
+public:
+    GaugeFn(const std::string &name, const std::string &help, std::function<int64_t()> fn);
+    int64_t value() const { return fn(); }
+
+private:
+    std::function<int64_t()> fn;
+};
+
+/**
+ * HDR-style latency histogram in microseconds.
+ * Log-linear buckets (32 per power of two, ~3% relative error) from
+ * 1 us to ~2^41 us. Recording is a few relaxed atomic adds, no locks.
+ */
+class Histogram {
+public:
+    Histogram(const std::string &name, const std::string &help);
+
+    /**
+     * Unregistered histogram, for breakdowns (e.g. per group) that the
+     * owner reports itself
+     */
+    Histogram();
+
+    /**
+     * Record one sample
+     * @param us Value in microseconds
+     */
+    void record(uint64_t us);
+
+    uint64_t count() const;
+    uint64_t sumMicros() const;
+    uint64_t max() const;
+    double mean() const;
+
+    /**
+     * Value at quantile q (0..1): the highest value equivalent to the
+     * bucket holding that rank, or 0 when empty
+     */
+    uint64_t percentile(double q) const;
+
+private:
+    static const int SUB_BITS = 5;
+    static const int SUB = 1 << SUB_BITS;
+    static const int MAX_EXP = 41;
+    static const int BUCKETS = SUB + (MAX_EXP - SUB_BITS) * SUB;
+
+    static int bucketFor(uint64_t us);
+    static uint64_t bucketHigh(int index);
+
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> total, sum, maxSeen;
+};
+
+/**
+ * Current value of every registered metric, one per line in text
+ * exposition format (HELP/TYPE comments, histograms as quantiles plus
+ * _count, _sum and _max)
+ */
+std::vector<std::string> renderMetrics();
+
+/**
+ * Microseconds from a monotonic clock, for timing what histograms record
+ */
+uint64_t monotonicMicros();
+
+/**
+ * Serve renderMetrics() on 127.0.0.1:port from a background thread.
+ * Plain connections get the text and are closed; HTTP GETs get it with
+ * a 200 header, so curl or a local scraper can poll it.
+ * @return false if the port could not be bound
+ */
+bool startMetricsServer(int port);
+
+#endif // METRICS_H
@@ -0,0 +1,423 @@
+// Impairment proxy: listens on a local port and relays every connection to
+// one target (a tsamgroup1 instance, or the server a client talks to),
+// making the path behave like a real WAN link instead of loopback. Each
+// direction of each connection is shaped on its own:
+//   latency + jitter  every chunk read is held for --latency-ms plus a
+//                     uniform 0..--jitter-ms, never overtaking earlier data
+//   bandwidth         --bandwidth-kbps serializes chunks at that rate
+//   stalls            with probability --stall per chunk, the direction
+//                     freezes for --stall-ms (a long retransmit, a full queue)
+//   splits            with probability --split per chunk, it is cut at a
+//                     random byte and the tail follows --split-delay-ms later,
+//                     so receivers see partial frames
+//   resets            with probability --reset per chunk, both sides of the
+//                     connection are aborted with RST
+// No root, tc or netem needed. Put one proxy in front of each server whose
+// inbound links should be impaired, and point peers at the proxy's port.
+//
+// Sessions are logged to stderr as they close. On SIGINT/SIGTERM a JSON
+// summary goes to stdout (or --out=FILE).
+#include "metrics.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const size_t READ_CHUNK = 16384;
+const size_t MAX_BUFFERED = 1 << 20;  // Per direction; beyond it we stop reading (backpressure)
+
+struct Config {
+    int listenPort = 0;
+    std::string targetHost;
+    int targetPort = 0;
+    double latencyMs = 0;
+    double jitterMs = 0;
+    double bandwidthKbps = 0;  // 0 = unlimited
+    double stall = 0;
+    double stallMs = 1000;
+    double split = 0;
+    double splitDelayMs = 50;
+    double reset = 0;
+    unsigned seed = 1;
+    std::string out;
+};
+
+struct Chunk {
+    uint64_t dueUs;  // monotonicMicros() when it may be written
+    std::string data;
+};
+
+// One direction of a session: bytes read from `from` wait in pending until due, then go to `to`
+struct Direction {
+    int from, to;
+    std::deque<Chunk> pending;
+    size_t buffered;
+    uint64_t lastDueUs;   // Chunks never overtake each other
+    uint64_t wireFreeUs;  // When the bandwidth cap lets the next chunk start
+    bool eof, shutDown;
+    uint64_t bytes, splits, stalls;
+};
+
+struct Session {
+    unsigned long id;
+    int client, server;
+    bool connected;
+    Direction up, down;  // Client -> target, target -> client
+    uint64_t openedUs;
+    bool done, abortive;  // abortive: close with RST (injected reset, or the target refused us)
+    std::string reason;
+};
+
+static Config config;
+static std::list<Session> sessions;
+static std::mt19937 rng;
+static volatile sig_atomic_t stopping = 0;
+static struct sockaddr_storage targetAddr;
+static socklen_t targetLen;
+
+// Totals for the summary
+static unsigned long sessionsOpened, connectFailures, resetsInjected;
+static uint64_t bytesUp, bytesDown, splitsInjected, stallsInjected;
+
+static void onSignal(int) {
+    stopping = 1;
+}
+
+static double uniform(double lo, double hi) {
+    return std::uniform_real_distribution<double>(lo, hi)(rng);
+}
+
+static bool chance(double p) {
+    return p > 0 && uniform(0, 1) < p;
+}
+
+static void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Abort with RST rather than FIN, as a dropped NAT entry or crashed peer would
+static void abortSocket(int fd) {
+    struct linger lg = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+static void initDirection(Direction &d, int from, int to) {
+    d.from = from;
+    d.to = to;
+    d.buffered = 0;
+    d.lastDueUs = d.wireFreeUs = 0;
+    d.eof = d.shutDown = false;
+    d.bytes = d.splits = d.stalls = 0;
+}
+
+static void finish(Session &s, const std::string &reason, bool abortive = false) {
+    if (!s.done) {
+        s.done = true;
+        s.abortive = abortive;
+        s.reason = reason;
+    }
+}
+
+// Applies the impairments to one read and queues the result
+static void enqueue(Session &s, Direction &d, const char *data, size_t len, uint64_t now) {
+    if (chance(config.reset)) {
+        resetsInjected++;
+        finish(s, "reset injected", true);
+        return;
+    }
+    if (chance(config.stall)) {
+        d.stalls++;
+        stallsInjected++;
+        d.lastDueUs = std::max(d.lastDueUs, now + static_cast<uint64_t>(config.stallMs * 1000));
+    }
+    uint64_t due = now + static_cast<uint64_t>((config.latencyMs + uniform(0, config.jitterMs)) * 1000);
+    if (config.bandwidthKbps > 0) {
+        d.wireFreeUs = std::max(d.wireFreeUs, due) + static_cast<uint64_t>(len * 8000.0 / config.bandwidthKbps);
+        due = d.wireFreeUs;
+    }
+    due = std::max(due, d.lastDueUs);
+    d.buffered += len;
+
+    if (len >= 2 && chance(config.split)) {
+        size_t cut = std::uniform_int_distribution<size_t>(1, len - 1)(rng);
+        d.splits++;
+        splitsInjected++;
+        d.pending.push_back({due, std::string(data, cut)});
+        due += static_cast<uint64_t>(config.splitDelayMs * 1000);
+        d.pending.push_back({due, std::string(data + cut, len - cut)});
+    } else {
+        d.pending.push_back({due, std::string(data, len)});
+    }
+    d.lastDueUs = due;
+}
+
+static void readSide(Session &s, Direction &d, uint64_t now) {
+    char buf[READ_CHUNK];
+    while (!s.done && !d.eof && d.buffered < MAX_BUFFERED) {
+        ssize_t n = recv(d.from, buf, sizeof(buf), 0);
+        if (n > 0) {
+            enqueue(s, d, buf, n, now);
+            continue;
+        }
+        if (n == 0) d.eof = true;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            finish(s, std::string("read: ") + strerror(errno), errno == ECONNRESET);  // Pass a reset on as one
+        return;
+    }
+}
+
+static void writeSide(Session &s, Direction &d, uint64_t now) {
+    while (!s.done && !d.pending.empty() && d.pending.front().dueUs <= now) {
+        Chunk &c = d.pending.front();
+        ssize_t n = send(d.to, c.data.data(), c.data.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) finish(s, std::string("write: ") + strerror(errno));
+            return;
+        }
+        d.bytes += n;
+        d.buffered -= n;
+        c.data.erase(0, n);
+        if (!c.data.empty()) return;
+        d.pending.pop_front();
+    }
+    // Pass the half-close on once everything before it was delivered
+    if (d.eof && d.pending.empty() && !d.shutDown) {
+        shutdown(d.to, SHUT_WR);
+        d.shutDown = true;
+    }
+}
+
+static void closeSession(Session &s) {
+    if (s.abortive) {
+        abortSocket(s.client);
+        if (s.server >= 0) abortSocket(s.server);
+    } else {
+        close(s.client);
+        if (s.server >= 0) close(s.server);
+    }
+    bytesUp += s.up.bytes;
+    bytesDown += s.down.bytes;
+    fprintf(stderr, "session %lu closed after %.1fs: %s (up %llu bytes, down %llu bytes, %llu splits, %llu stalls)\n",
+            s.id, (monotonicMicros() - s.openedUs) / 1e6, s.reason.c_str(), (unsigned long long)s.up.bytes,
+            (unsigned long long)s.down.bytes, (unsigned long long)(s.up.splits + s.down.splits),
+            (unsigned long long)(s.up.stalls + s.down.stalls));
+}
+
+static void acceptAll(int listenSock) {
+    while (true) {
+        int client = accept(listenSock, NULL, NULL);
+        if (client < 0) return;
+        setNonBlocking(client);
+        int server = socket(targetAddr.ss_family, SOCK_STREAM, 0);
+        if (server >= 0) {
+            setNonBlocking(server);
+            if (connect(server, (struct sockaddr *)&targetAddr, targetLen) < 0 && errno != EINPROGRESS) {
+                close(server);
+                server = -1;
+            }
+        }
+        if (server < 0) {
+            connectFailures++;
+            abortSocket(client);
+            continue;
+        }
+        sessions.push_back(Session());
+        Session &s = sessions.back();
+        s.id = ++sessionsOpened;
+        s.client = client;
+        s.server = server;
+        s.connected = false;
+        s.openedUs = monotonicMicros();
+        s.done = s.abortive = false;
+        initDirection(s.up, client, server);
+        initDirection(s.down, server, client);
+        fprintf(stderr, "session %lu opened\n", s.id);
+    }
+}
+
+static bool resolveTarget() {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.targetHost.c_str(), std::to_string(config.targetPort).c_str(), &hints, &res) != 0)
+        return false;
+    memcpy(&targetAddr, res->ai_addr, res->ai_addrlen);
+    targetLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+static int openListener(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return sock;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s <listen_port> <target_host:port> [--latency-ms=MS] [--jitter-ms=MS] [--bandwidth-kbps=K]\n"
+           "       [--stall=P] [--stall-ms=MS] [--split=P] [--split-delay-ms=MS] [--reset=P] [--seed=S] [--out=FILE]\n"
+           "Each P is a probability per chunk read, applied to each direction separately.\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) { usage(argv[0]); return 1; }
+    config.listenPort = atoi(argv[1]);
+    std::string target = argv[2];
+    size_t colon = target.rfind(':');
+    if (colon == std::string::npos) { usage(argv[0]); return 1; }
+    config.targetHost = target.substr(0, colon);
+    config.targetPort = atoi(target.c_str() + colon + 1);
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq), val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--latency-ms") config.latencyMs = std::max(0.0, atof(val.c_str()));
+        else if (key == "--jitter-ms") config.jitterMs = std::max(0.0, atof(val.c_str()));
+        else if (key == "--bandwidth-kbps") config.bandwidthKbps = std::max(0.0, atof(val.c_str()));
+        else if (key == "--stall") config.stall = atof(val.c_str());
+        else if (key == "--stall-ms") config.stallMs = std::max(0.0, atof(val.c_str()));
+        else if (key == "--split") config.split = atof(val.c_str());
+        else if (key == "--split-delay-ms") config.splitDelayMs = std::max(0.0, atof(val.c_str()));
+        else if (key == "--reset") config.reset = atof(val.c_str());
+        else if (key == "--seed") config.seed = atoi(val.c_str());
+        else if (key == "--out") config.out = val;
+        else { usage(argv[0]); return 1; }
+    }
+    if (!resolveTarget()) {
+        fprintf(stderr, "Cannot resolve %s\n", config.targetHost.c_str());
+        return 1;
+    }
+    int listenSock = openListener(config.listenPort);
+    if (listenSock < 0) {
+        fprintf(stderr, "Cannot listen on port %d: %s\n", config.listenPort, strerror(errno));
+        return 1;
+    }
+    rng.seed(config.seed);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    fprintf(stderr, "Proxying :%d -> %s:%d (latency %.1f+%.1fms, %s, stall %.3f x %.0fms, split %.3f, reset %.3f)\n",
+            config.listenPort, config.targetHost.c_str(), config.targetPort, config.latencyMs, config.jitterMs,
+            config.bandwidthKbps > 0 ? (std::to_string((int)config.bandwidthKbps) + " kbit/s").c_str() : "no bandwidth cap",
+            config.stall, config.stallMs, config.split, config.reset);
+
+    uint64_t startUs = monotonicMicros();
+    std::vector<struct pollfd> fds;
+    std::vector<Session *> owners;  // Per fds entry after the listener: its session
+    while (!stopping) {
+        uint64_t now = monotonicMicros();
+        fds.clear();
+        owners.clear();
+        fds.push_back({listenSock, POLLIN, 0});
+        uint64_t nextDue = UINT64_MAX;
+        for (Session &s : sessions) {
+            for (Direction *d : {&s.up, &s.down}) {
+                short events = 0;
+                if (!d->eof && d->buffered < MAX_BUFFERED && (s.connected || d == &s.up)) events |= POLLIN;
+                if (!d->pending.empty()) {
+                    if (d->pending.front().dueUs <= now) {
+                        if (s.connected || d == &s.down) events |= POLLOUT;
+                    } else {
+                        nextDue = std::min(nextDue, d->pending.front().dueUs);
+                    }
+                }
+                // Reads poll the source socket, writes the destination
+                if (events & POLLIN) { fds.push_back({d->from, POLLIN, 0}); owners.push_back(&s); }
+                if (events & POLLOUT) { fds.push_back({d->to, POLLOUT, 0}); owners.push_back(&s); }
+            }
+            if (!s.connected) { fds.push_back({s.server, POLLOUT, 0}); owners.push_back(&s); }
+        }
+        int timeout = nextDue == UINT64_MAX ? 1000 : static_cast<int>(std::min<uint64_t>((nextDue - now + 999) / 1000, 1000));
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) break;
+        now = monotonicMicros();
+
+        if (fds[0].revents & POLLIN) acceptAll(listenSock);
+        for (size_t i = 1; i < fds.size(); i++) {
+            Session &s = *owners[i - 1];
+            if (!fds[i].revents || s.done) continue;
+            if (!s.connected && fds[i].fd == s.server && (fds[i].events & POLLOUT)) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(s.server, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    connectFailures++;
+                    finish(s, std::string("connect: ") + strerror(err), true);
+                    continue;
+                }
+                s.connected = true;
+            }
+        }
+        // Every session does its due reads and writes, whichever descriptor woke us
+        for (Session &s : sessions) {
+            if (s.done) continue;
+            readSide(s, s.up, now);
+            if (s.connected) readSide(s, s.down, now);
+            if (s.connected) writeSide(s, s.up, now);
+            writeSide(s, s.down, now);
+            if (s.up.shutDown && s.down.shutDown) finish(s, "closed");
+        }
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            if (!it->done) { ++it; continue; }
+            closeSession(*it);
+            it = sessions.erase(it);
+        }
+    }
+
+    for (Session &s : sessions) {
+        finish(s, "proxy stopped");
+        closeSession(s);
+    }
+    close(listenSock);
+    std::ostringstream report;
+    report << "{\n  \"config\": {\"listen_port\": " << config.listenPort << ", \"target\": \"" << config.targetHost << ":"
+           << config.targetPort << "\", \"latency_ms\": " << config.latencyMs << ", \"jitter_ms\": " << config.jitterMs
+           << ", \"bandwidth_kbps\": " << config.bandwidthKbps << ", \"stall\": " << config.stall
+           << ", \"stall_ms\": " << config.stallMs << ", \"split\": " << config.split
+           << ", \"split_delay_ms\": " << config.splitDelayMs << ", \"reset\": " << config.reset
+           << ", \"seed\": " << config.seed << "},\n";
+    report << "  \"uptime_s\": " << (monotonicMicros() - startUs) / 1e6 << ",\n";
+    report << "  \"sessions\": " << sessionsOpened << ", \"connect_failures\": " << connectFailures
+           << ", \"resets_injected\": " << resetsInjected << ", \"splits_injected\": " << splitsInjected
+           << ", \"stalls_injected\": " << stallsInjected << ",\n";
+    report << "  \"bytes_up\": " << bytesUp << ", \"bytes_down\": " << bytesDown << "\n}\n";
+    if (config.out.empty()) std::cout << report.str();
+    else {
+        std::ofstream(config.out.c_str()) << report.str();
+        fprintf(stderr, "Report written to %s\n", config.out.c_str());
+    }
+    return 0;
+}
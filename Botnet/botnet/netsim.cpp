@@ -0,0 +1,363 @@
+// Discrete-event simulator for the routing core: runs thousands of virtual
+// nodes in one process, each a RouterCore (the same code the server routes
+// with) on a shared virtual clock. Links are in-memory, in-order queues with
+// a fixed latency plus uniform jitter and an optional frame loss rate.
+//
+// Nodes are wired as a line, ring or random graph and registered as peers at
+// time zero, each asking its peers for STATUSREQ as the server does. Client
+// messages are injected between random node pairs at a fixed pace; KEEPALIVE
+// rounds (as in the server's keepalive timer) pull queued messages onward.
+// Every injected message has unique content, so unlike the server the
+// routers drop repeat copies (--duplicate-window) and floods stay bounded.
+// The run ends when no events are left or at --duration-s of virtual time,
+// and reports delivery, hop counts against the shortest path, and how many
+// frames the network sent per message. A run that outgrows --max-events,
+// --max-pending (frames in flight) or --max-queued (messages held by all
+// routers) is cut short and reported with "stop": "event_limit".
+//
+// Everything is driven by one seeded generator and a total event order, so
+// a run with the same options reproduces the same report byte for byte.
+//
+// The report is JSON on stdout (or --out=FILE); progress and wall time go to
+// stderr. Exit status: 0, 1 if delivery fell short of --min-delivery, 2 if a
+// limit cut the run short.
+#include "router.h"
+#include "protocol.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Config {
+    std::string topology = "random";
+    int nodes = 1000;
+    double degree = 3;       // Mean degree of the random graph
+    int messages = 100;
+    double intervalMs = 10;  // Between injected messages
+    double latencyMs = 5;
+    double jitterMs = 1;
+    double loss = 0;         // Probability that a frame is dropped on its link
+    int keepaliveS = 60;     // 0 disables KEEPALIVE rounds
+    int ttlS = 3600;
+    int duplicateWindowS = 600;  // Every injected message has unique content, so routers can drop repeat copies
+    int durationS = 300;     // Virtual time limit
+    uint64_t maxEvents = 5000000;
+    uint64_t maxPending = 1000000;
+    uint64_t maxQueued = 2000000;
+    double minDelivery = 0;  // Fraction of messages that must arrive for exit status 0
+    unsigned seed = 1;
+    std::string out;
+};
+
+enum EventType { EV_FRAME, EV_INJECT, EV_KEEPALIVE };
+
+// Kept small so the heap stays cache friendly at millions of pending frames;
+// the command itself waits in a pooled slot
+struct Event {
+    uint64_t at, seq;  // Virtual microseconds; seq orders events due at the same time
+    EventType type;
+    int node, from;    // EV_FRAME: receiver and sender; EV_INJECT: source, from = message id
+    uint32_t payload;  // EV_FRAME: slot in payloads
+    bool operator>(const Event &o) const { return at != o.at ? at > o.at : seq > o.seq; }
+};
+
+struct SimNode {
+    std::string groupId;
+    std::set<int> neighbors;
+    std::unique_ptr<RouterCore> router;
+};
+
+// Per injected message
+struct Injected {
+    int src, dst;
+    uint64_t sentAt;
+    int copies;  // Times it reached the destination
+};
+
+static Config config;
+static std::vector<SimNode> nodes;
+static std::vector<Injected> injected;
+static std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+static std::vector<std::string> payloads;
+static std::vector<uint32_t> freePayloads;
+static std::unordered_map<uint64_t, uint64_t> linkBusyUntil;  // Directed link -> last arrival, keeps links in order
+static std::mt19937 rng;
+static uint64_t simNow = 0, nextSeq = 0;
+
+// Totals for the report
+static uint64_t framesByKind[4], framesLost, loops, duplicatesDropped, eventsRun, queuedNow;
+static Histogram latencyUs;
+static std::map<int, uint64_t> hopCounts, shortest;
+
+static void schedule(uint64_t at, EventType type, int node, int from, const std::string &command = "") {
+    uint32_t slot = 0;
+    if (type == EV_FRAME) {
+        if (freePayloads.empty()) {
+            slot = payloads.size();
+            payloads.push_back(command);
+        } else {
+            slot = freePayloads.back();
+            freePayloads.pop_back();
+            payloads[slot] = command;
+        }
+    }
+    events.push({at, nextSeq++, type, node, from, slot});
+}
+
+// A node's transport: count the frame, maybe lose it, and deliver it after the link delay
+static void transmit(int from, const Outgoing &out) {
+    framesByKind[out.kind]++;
+    if (config.loss > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < config.loss) {
+        framesLost++;
+        return;
+    }
+    uint64_t delay = static_cast<uint64_t>(config.latencyMs * 1000);
+    if (config.jitterMs > 0)
+        delay += static_cast<uint64_t>(std::uniform_real_distribution<double>(0, config.jitterMs * 1000)(rng));
+    uint64_t &busy = linkBusyUntil[static_cast<uint64_t>(from) * nodes.size() + out.link];
+    busy = std::max(busy, simNow + delay);
+    schedule(busy, EV_FRAME, out.link, from, out.command);
+}
+
+static void buildTopology() {
+    int n = config.nodes;
+    auto link = [](int a, int b) {
+        if (a == b) return;
+        nodes[a].neighbors.insert(b);
+        nodes[b].neighbors.insert(a);
+    };
+    for (int i = 0; i + 1 < n; i++) {
+        // A random spanning tree keeps the random graph connected
+        if (config.topology == "random") link(i + 1, std::uniform_int_distribution<int>(0, i)(rng));
+        else link(i, i + 1);
+    }
+    if (config.topology == "ring" && n > 2) link(n - 1, 0);
+    if (config.topology == "random") {
+        double extra = std::max(0.0, config.degree * n / 2 - (n - 1));
+        std::uniform_int_distribution<int> pick(0, n - 1);
+        for (uint64_t tries = 0; extra >= 1 && tries < static_cast<uint64_t>(n) * 100; tries++) {
+            int a = pick(rng), b = pick(rng);
+            if (a == b || nodes[a].neighbors.count(b)) continue;
+            link(a, b);
+            extra--;
+        }
+    }
+}
+
+static int distance(int src, int dst) {
+    std::vector<int> dist(nodes.size(), -1);
+    std::queue<int> q;
+    dist[src] = 0;
+    q.push(src);
+    while (!q.empty() && dist[dst] < 0) {
+        int u = q.front();
+        q.pop();
+        for (int v : nodes[u].neighbors)
+            if (dist[v] < 0) { dist[v] = dist[u] + 1; q.push(v); }
+    }
+    return dist[dst];
+}
+
+static void onFrame(const Event &ev) {
+    std::string command, main, hops;
+    command.swap(payloads[ev.payload]);
+    freePayloads.push_back(ev.payload);
+    parseSENDMSGWithHops(command, main, hops);
+    RouteResult r = nodes[ev.node].router->handle(ev.from, parseCommand(main), hops);
+    if (r.action == ROUTE_LOOPED) loops++;
+    if (r.action == ROUTE_DUPLICATE) duplicatesDropped++;
+    if (r.action != ROUTE_DELIVERED) return;
+    // Content is "m<id>"; copies that arrive after the first are duplicates
+    size_t id = strtoul(r.message.content.c_str() + 1, NULL, 10);
+    if (r.message.content[0] != 'm' || id >= injected.size()) return;
+    Injected &m = injected[id];
+    if (m.copies++ == 0) {
+        latencyUs.record(simNow - m.sentAt);
+        hopCounts[r.message.hopCount]++;
+    }
+}
+
+// The server's keepaliveTimer: tell every peer how many messages we hold for it
+static void onKeepalive(const Event &ev) {
+    SimNode &node = nodes[ev.node];
+    for (int peer : node.neighbors)
+        transmit(ev.node, {peer, OUT_CONTROL, buildKEEPALIVE(node.router->queuedFor(nodes[peer].groupId)), nullptr,
+                           Message()});
+    schedule(simNow + static_cast<uint64_t>(config.keepaliveS) * 1000000, EV_KEEPALIVE, ev.node, -1);
+}
+
+static std::string histogramJson(const Histogram &h) {
+    std::ostringstream s;
+    s << "{\"count\": " << h.count() << ", \"mean\": " << static_cast<uint64_t>(h.mean())
+      << ", \"p50\": " << h.percentile(0.5) << ", \"p90\": " << h.percentile(0.9)
+      << ", \"p99\": " << h.percentile(0.99) << ", \"max\": " << h.max() << "}";
+    return s.str();
+}
+
+static std::string mapJson(const std::map<int, uint64_t> &m) {
+    std::ostringstream s;
+    s << "{";
+    bool first = true;
+    for (const auto &e : m) { s << (first ? "" : ", ") << "\"" << e.first << "\": " << e.second; first = false; }
+    s << "}";
+    return s.str();
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [--nodes=M] [--topology=line|ring|random] [--degree=D] [--messages=N] [--interval-ms=MS]\n"
+           "       [--latency-ms=MS] [--jitter-ms=MS] [--loss=P] [--keepalive=SEC] [--ttl=SEC] [--duplicate-window=SEC]\n"
+           "       [--duration-s=SEC] [--max-events=N] [--max-pending=N] [--max-queued=N] [--min-delivery=F]\n"
+           "       [--seed=S] [--out=FILE]\n"
+           "All times are virtual; --loss is the chance each frame is dropped on its link.\n"
+           "--duplicate-window=0 turns off duplicate suppression (as in the server) to see raw flooding.\n"
+           "Exits 1 if fewer than --min-delivery (0..1) of the messages arrive, 2 if a limit stopped the run.\n",
+           prog);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq), val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--nodes") config.nodes = std::max(2, atoi(val.c_str()));
+        else if (key == "--topology") config.topology = val;
+        else if (key == "--degree") config.degree = atof(val.c_str());
+        else if (key == "--messages") config.messages = std::max(0, atoi(val.c_str()));
+        else if (key == "--interval-ms") config.intervalMs = std::max(0.0, atof(val.c_str()));
+        else if (key == "--latency-ms") config.latencyMs = std::max(0.0, atof(val.c_str()));
+        else if (key == "--jitter-ms") config.jitterMs = std::max(0.0, atof(val.c_str()));
+        else if (key == "--loss") config.loss = atof(val.c_str());
+        else if (key == "--keepalive") config.keepaliveS = std::max(0, atoi(val.c_str()));
+        else if (key == "--ttl") config.ttlS = std::max(0, atoi(val.c_str()));
+        else if (key == "--duplicate-window") config.duplicateWindowS = std::max(0, atoi(val.c_str()));
+        else if (key == "--duration-s") config.durationS = std::max(1, atoi(val.c_str()));
+        else if (key == "--max-events") config.maxEvents = strtoull(val.c_str(), NULL, 10);
+        else if (key == "--max-pending") config.maxPending = strtoull(val.c_str(), NULL, 10);
+        else if (key == "--max-queued") config.maxQueued = strtoull(val.c_str(), NULL, 10);
+        else if (key == "--min-delivery") config.minDelivery = atof(val.c_str());
+        else if (key == "--seed") config.seed = atoi(val.c_str());
+        else if (key == "--out") config.out = val;
+        else { usage(argv[0]); return 1; }
+    }
+    if (config.topology != "line" && config.topology != "ring" && config.topology != "random") {
+        usage(argv[0]);
+        return 1;
+    }
+    uint64_t wallStart = monotonicMicros();
+    rng.seed(config.seed);
+
+    nodes.resize(config.nodes);
+    for (int i = 0; i < config.nodes; i++) {
+        nodes[i].groupId = "N_" + std::to_string(i + 1);
+        nodes[i].router.reset(new RouterCore(nodes[i].groupId, [i](const Outgoing &out) { transmit(i, out); },
+                                             [] { return simNow; }));
+        nodes[i].router->ttlSeconds = config.ttlS;
+        nodes[i].router->duplicateWindowSeconds = config.duplicateWindowS;
+        nodes[i].router->onQueue = [](QueueEvent event, const Message &, uint64_t) {
+            event == MESSAGE_QUEUED ? queuedNow++ : queuedNow--;
+        };
+    }
+    buildTopology();
+    size_t edges = 0;
+    for (const auto &n : nodes) edges += n.neighbors.size();
+    edges /= 2;
+
+    // Every link is up at time zero; each side asks what the other holds (onPeerRegistered)
+    std::uniform_int_distribution<uint64_t> phase(0, static_cast<uint64_t>(config.keepaliveS) * 1000000);
+    for (int i = 0; i < config.nodes; i++) {
+        for (int peer : nodes[i].neighbors) nodes[i].router->addPeer(peer, nodes[peer].groupId);
+        for (int peer : nodes[i].neighbors)
+            transmit(i, {peer, OUT_CONTROL, buildSTATUSREQ(), nullptr, Message()});
+        if (config.keepaliveS > 0) schedule(phase(rng), EV_KEEPALIVE, i, -1);
+    }
+    std::uniform_int_distribution<int> pick(0, config.nodes - 1);
+    for (int m = 0; m < config.messages; m++) {
+        int src = pick(rng), dst = pick(rng);
+        while (dst == src) dst = pick(rng);
+        uint64_t at = static_cast<uint64_t>(m * config.intervalMs * 1000);
+        injected.push_back({src, dst, at, 0});
+        schedule(at, EV_INJECT, src, m);
+    }
+    fprintf(stderr, "%d nodes, %zu edges (%s), %d messages\n", config.nodes, edges, config.topology.c_str(),
+            config.messages);
+
+    uint64_t endAt = static_cast<uint64_t>(config.durationS) * 1000000;
+    std::string stop = "drained", limit;
+    while (!events.empty()) {
+        if (events.top().at > endAt) { stop = "duration"; break; }
+        if (eventsRun >= config.maxEvents) limit = "max_events";
+        else if (events.size() > config.maxPending) limit = "max_pending";
+        else if (queuedNow > config.maxQueued) limit = "max_queued";
+        if (!limit.empty()) {
+            stop = "event_limit";
+            fprintf(stderr, "Stopped at %s: %llu events, %zu pending, %llu queued, t=%.3fs\n", limit.c_str(),
+                    (unsigned long long)eventsRun, events.size(), (unsigned long long)queuedNow, simNow / 1e6);
+            break;
+        }
+        Event ev = events.top();
+        events.pop();
+        simNow = ev.at;
+        eventsRun++;
+        if (ev.type == EV_FRAME) onFrame(ev);
+        else if (ev.type == EV_KEEPALIVE) onKeepalive(ev);
+        else {
+            const Injected &m = injected[ev.from];
+            nodes[ev.node].router->originate(nodes[m.dst].groupId, "m" + std::to_string(ev.from));
+        }
+        if (eventsRun % 1000000 == 0)
+            fprintf(stderr, "%llu events, t=%.3fs, %zu pending\n", (unsigned long long)eventsRun, simNow / 1e6,
+                    events.size());
+    }
+
+    uint64_t delivered = 0, duplicates = 0, queued = 0;
+    for (const auto &m : injected) {
+        if (m.copies == 0) continue;
+        delivered++;
+        duplicates += m.copies - 1;
+        shortest[distance(m.src, m.dst)]++;
+    }
+    for (const auto &n : nodes) queued += n.router->queued();
+    bool enough = config.messages == 0 || delivered >= config.minDelivery * config.messages;
+    uint64_t frames = framesByKind[OUT_CONTROL] + framesByKind[OUT_FLOOD] + framesByKind[OUT_FORWARD] +
+                      framesByKind[OUT_HANDOFF];
+    uint64_t messageFrames = frames - framesByKind[OUT_CONTROL];
+    fprintf(stderr, "Simulated %.3fs in %.0f ms of wall time\n", simNow / 1e6, (monotonicMicros() - wallStart) / 1000.0);
+
+    std::ostringstream s;
+    s << "{\n  \"config\": {\"nodes\": " << config.nodes << ", \"topology\": \"" << config.topology
+      << "\", \"edges\": " << edges << ", \"messages\": " << config.messages << ", \"latency_ms\": " << config.latencyMs
+      << ", \"jitter_ms\": " << config.jitterMs << ", \"loss\": " << config.loss << ", \"keepalive_s\": "
+      << config.keepaliveS << ", \"seed\": " << config.seed << "},\n";
+    s << "  \"run\": {\"stop\": \"" << stop << "\", \"limit\": " << (limit.empty() ? "null" : "\"" + limit + "\"")
+      << ", \"events\": " << eventsRun << ", \"pending_events\": " << events.size() << ", \"virtual_s\": "
+      << simNow / 1e6 << "},\n";
+    s << "  \"delivery\": {\"delivered\": " << delivered << ", \"lost\": " << config.messages - delivered
+      << ", \"duplicates_per_message\": " << (delivered ? (double)duplicates / delivered : 0)
+      << ", \"latency_us\": " << histogramJson(latencyUs) << "},\n";
+    s << "  \"frames\": {\"total\": " << frames << ", \"control\": " << framesByKind[OUT_CONTROL]
+      << ", \"flood\": " << framesByKind[OUT_FLOOD] << ", \"forward\": " << framesByKind[OUT_FORWARD]
+      << ", \"handoff\": " << framesByKind[OUT_HANDOFF] << ", \"lost\": " << framesLost
+      << ", \"message_frames_per_message\": " << (config.messages ? (double)messageFrames / config.messages : 0)
+      << ", \"loops_dropped\": " << loops << ", \"duplicates_dropped\": " << duplicatesDropped
+      << ", \"queued_at_end\": " << queued << "},\n";
+    s << "  \"hops\": " << mapJson(hopCounts) << ",\n";
+    s << "  \"shortest_path\": " << mapJson(shortest) << "\n}\n";
+    if (config.out.empty()) std::cout << s.str();
+    else {
+        std::ofstream(config.out.c_str()) << s.str();
+        fprintf(stderr, "Report written to %s\n", config.out.c_str());
+    }
+    if (!limit.empty()) return 2;
+    return enough ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#include "peerstats.h"
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <atomic>
+#include <cstring>
+
+const int MAX_TRACKED_FDS = 1024;
+
+static const char *KIND_NAMES[FRAME_KINDS] = {
+    "HELO", "SERVERS", "KEEPALIVE", "GETMSGS", "SENDMSG", "STATUSREQ", "STATUSRESP", "NO_MESSAGES", "OTHER"
+};
+
+struct Slot {
+    std::atomic<uint64_t> bytesIn, bytesOut, framesIn, framesOut, stallUs, maxStallUs;
+    std::atomic<uint64_t> sendsOk, sendsFailed;
+    std::atomic<uint64_t> kindIn[FRAME_KINDS], kindOut[FRAME_KINDS];
+    std::atomic<int> outq;
+    std::atomic<uint32_t> rttUs, rttvarUs, retransmits, cwnd;
+};
+
+static Slot slots[MAX_TRACKED_FDS];  // Static storage starts zeroed
+
+static Slot *slotFor(int fd) {
+    return fd >= 0 && fd < MAX_TRACKED_FDS ? &slots[fd] : nullptr;
+}
+
+// The command name ends at the first ',' or at the EOT before the hop list
+static int kindOf(const char *command, size_t length) {
+    size_t n = 0;
+    while (n < length && command[n] != ',' && command[n] != '\x04') n++;
+    for (int k = 0; k < KIND_OTHER; k++)
+        if (strlen(KIND_NAMES[k]) == n && memcmp(KIND_NAMES[k], command, n) == 0) return k;
+    return KIND_OTHER;
+}
+
+const char *frameKindName(const char *command, size_t length) {
+    return KIND_NAMES[kindOf(command, length)];
+}
+
+void resetPeerStats(int fd) {
+    Slot *s = slotFor(fd);
+    if (!s) return;
+    s->bytesIn = 0; s->bytesOut = 0; s->framesIn = 0; s->framesOut = 0;
+    s->stallUs = 0; s->maxStallUs = 0;
+    s->sendsOk = 0; s->sendsFailed = 0;
+    for (int k = 0; k < FRAME_KINDS; k++) { s->kindIn[k] = 0; s->kindOut[k] = 0; }
+    s->outq = 0; s->rttUs = 0; s->rttvarUs = 0; s->retransmits = 0; s->cwnd = 0;
+}
+
+void countPeerFrame(int fd, const char *command, size_t length, bool outgoing, uint64_t elapsedUs) {
+    Slot *s = slotFor(fd);
+    if (!s) return;
+    const std::memory_order relaxed = std::memory_order_relaxed;
+    uint64_t bytes = length + 5;  // Frame header and trailer
+    int kind = kindOf(command, length);
+    if (outgoing) {
+        s->bytesOut.fetch_add(bytes, relaxed);
+        s->framesOut.fetch_add(1, relaxed);
+        s->kindOut[kind].fetch_add(1, relaxed);
+        s->stallUs.fetch_add(elapsedUs, relaxed);
+        uint64_t seen = s->maxStallUs.load(relaxed);
+        while (elapsedUs > seen && !s->maxStallUs.compare_exchange_weak(seen, elapsedUs, relaxed)) {}
+    } else {
+        s->bytesIn.fetch_add(bytes, relaxed);
+        s->framesIn.fetch_add(1, relaxed);
+        s->kindIn[kind].fetch_add(1, relaxed);
+    }
+}
+
+void countPeerSend(int fd, bool ok) {
+    Slot *s = slotFor(fd);
+    if (!s) return;
+    (ok ? s->sendsOk : s->sendsFailed).fetch_add(1, std::memory_order_relaxed);
+}
+
+bool samplePeerTcp(int fd) {
+    Slot *s = slotFor(fd);
+    if (!s) return false;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    int outq = 0;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || ioctl(fd, SIOCOUTQ, &outq) < 0)
+        return false;
+    s->outq = outq;
+    s->rttUs = info.tcpi_rtt;
+    s->rttvarUs = info.tcpi_rttvar;
+    s->retransmits = info.tcpi_total_retrans;
+    s->cwnd = info.tcpi_snd_cwnd;
+    return true;
+}
+
+PeerStats peerStats(int fd) {
+    PeerStats p;
+    memset(&p, 0, sizeof(p));
+    Slot *s = slotFor(fd);
+    if (!s) return p;
+    p.bytesIn = s->bytesIn; p.bytesOut = s->bytesOut;
+    p.framesIn = s->framesIn; p.framesOut = s->framesOut;
+    p.stallUs = s->stallUs; p.maxStallUs = s->maxStallUs;
+    p.sendsOk = s->sendsOk; p.sendsFailed = s->sendsFailed;
+    for (int k = 0; k < FRAME_KINDS; k++) { p.kindIn[k] = s->kindIn[k]; p.kindOut[k] = s->kindOut[k]; }
+    p.outq = s->outq;
+    p.rttUs = s->rttUs; p.rttvarUs = s->rttvarUs; p.retransmits = s->retransmits; p.cwnd = s->cwnd;
+    return p;
+}
+
+std::string formatPeerStats(const PeerStats &p) {
+    std::string out = "in=" + std::to_string(p.bytesIn) + "B/" + std::to_string(p.framesIn) +
+                      " out=" + std::to_string(p.bytesOut) + "B/" + std::to_string(p.framesOut) + " cmds=";
+    bool first = true;
+    for (int k = 0; k < FRAME_KINDS; k++) {
+        if (!p.kindIn[k] && !p.kindOut[k]) continue;
+        out += std::string(first ? "" : "|") + KIND_NAMES[k] + ":" + std::to_string(p.kindIn[k]) + "/" +
+               std::to_string(p.kindOut[k]);
+        first = false;
+    }
+    if (first) out += "-";
+    out += " stall_us=" + std::to_string(p.stallUs) + " max_stall_us=" + std::to_string(p.maxStallUs) +
+           " outq=" + std::to_string(p.outq) + " rtt_us=" + std::to_string(p.rttUs) +
+           " rttvar_us=" + std::to_string(p.rttvarUs) + " retrans=" + std::to_string(p.retransmits) +
+           " cwnd=" + std::to_string(p.cwnd);
+    return out;
+}
@@ -0,0 +1,70 @@
+#ifndef PEERSTATS_H
+#define PEERSTATS_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Command types counted separately per connection
+ */
+enum FrameKind {
+    KIND_HELO, KIND_SERVERS, KIND_KEEPALIVE, KIND_GETMSGS, KIND_SENDMSG,
+    KIND_STATUSREQ, KIND_STATUSRESP, KIND_NO_MESSAGES, KIND_OTHER, FRAME_KINDS
+};
+
+/**
+ * Command name of a frame as one of the counted kinds ("OTHER" if none)
+ */
+const char *frameKindName(const char *command, size_t length);
+
+/**
+ * Traffic and kernel view of one connection at one moment
+ */
+struct PeerStats {
+    uint64_t bytesIn, bytesOut, framesIn, framesOut;
+    uint64_t kindIn[FRAME_KINDS], kindOut[FRAME_KINDS];
+    uint64_t stallUs;      // Total time spent inside send()
+    uint64_t maxStallUs;   // Longest single send
+    uint64_t sendsOk, sendsFailed;  // Relayed commands (countPeerSend)
+    // Sampled by samplePeerTcp()
+    int outq;              // Bytes in our send queue not yet acked (SIOCOUTQ)
+    uint32_t rttUs, rttvarUs, retransmits, cwnd;
+};
+
+/**
+ * Zero a socket's statistics; call when a new peer takes the descriptor
+ */
+void resetPeerStats(int fd);
+
+/**
+ * Count one frame. Has the FrameObserver signature so it can be passed
+ * straight to setFrameObserver(). Lock-free: every field is a relaxed
+ * atomic in a table indexed by descriptor (descriptors past the table
+ * are not tracked).
+ */
+void countPeerFrame(int fd, const char *command, size_t length, bool outgoing, uint64_t elapsedUs);
+
+/**
+ * Count the outcome of one relayed command towards the peer's delivery rate.
+ * Lock-free, like countPeerFrame().
+ */
+void countPeerSend(int fd, bool ok);
+
+/**
+ * Read TCP_INFO (rtt, rttvar, retransmits, cwnd) and SIOCOUTQ for a socket into its stats
+ * @return false if the kernel calls failed
+ */
+bool samplePeerTcp(int fd);
+
+/**
+ * Current statistics of a socket
+ */
+PeerStats peerStats(int fd);
+
+/**
+ * One-line summary: in/out bytes and frames, per-command counts, stall, queue and TCP_INFO
+ */
+std::string formatPeerStats(const PeerStats &stats);
+
+#endif // PEERSTATS_H
@@ -8,10 +8,22 @@
 #include <ctime>
 #include <iomanip>
 
-bool sendCommand(int socket, const std::string& command) {
+static FrameObserver frameObserver = nullptr;
+
+void setFrameObserver(FrameObserver observer) {
+    frameObserver = observer;
+}
+
+static uint64_t nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+std::string encodeFrame(const std::string& command) {
     if (command.length() > MAX_MESSAGE_LENGTH - HEADER_SIZE) {
         std::cerr << "Command too long: " << command.length() << " bytes" << std::endl;
-        return false;
+        return "";
     }
 
     uint16_t totalLength = command.length() + HEADER_SIZE;
@@ -26,7 +38,43 @@ bool sendCommand(int socket, const std::string& command) {
     frame += STX;
     frame += command;
     frame += ETX;
+    return frame;
+}
+
+int frameBytesNeeded(const std::string& buffer) {
+    // SOH + 2 length bytes tell us the full size
+    if (buffer.length() < 3) return 3 - buffer.length();
+    if (buffer[0] != SOH) return -1;
+
+    uint16_t totalLength = (static_cast<unsigned char>(buffer[1]) << 8) | 
+                           static_cast<unsigned char>(buffer[2]);
+    if (totalLength < HEADER_SIZE || totalLength > MAX_MESSAGE_LENGTH) return -1;
+    return buffer.length() >= totalLength ? 0 : totalLength - buffer.length();
+}
+
+int extractFrame(std::string& buffer, std::string& command) {
+    int needed = frameBytesNeeded(buffer);
+    if (needed != 0) return needed < 0 ? -1 : 0;
+
+    uint16_t totalLength = (static_cast<unsigned char>(buffer[1]) << 8) | 
+                           static_cast<unsigned char>(buffer[2]);
+    if (buffer[3] != STX || buffer[totalLength - 1] != ETX) return -1;
+
+    command = buffer.substr(4, totalLength - HEADER_SIZE);
+    buffer.erase(0, totalLength);
+    return 1;
+}
+
+bool sendCommand(int socket, const std::string& command) {
+    return sendFrame(socket, encodeFrame(command));
+}
+
+bool sendFrame(int socket, const std::string& frame) {
+    if (frame.empty()) {
+        return false;
+    }
 
+    uint64_t started = frameObserver ? nowMicros() : 0;
     size_t totalSent = 0;
     while (totalSent < frame.length()) {
         ssize_t sent = send(socket, frame.c_str() + totalSent, frame.length() - totalSent, 0);
@@ -37,6 +85,8 @@ bool sendCommand(int socket, const std::string& command) {
         totalSent += sent;
     }
 
+    if (frameObserver)
+        frameObserver(socket, frame.data() + 4, frame.length() - HEADER_SIZE, true, nowMicros() - started);
     return true;
 }
 
@@ -54,6 +104,7 @@ bool receiveCommand(int socket, std::string& command) {
                   << (int)(unsigned char)buffer[0] << std::dec << std::endl;
         return false;
     }
+    uint64_t started = frameObserver ? nowMicros() : 0;
 
     // Read length (2 bytes) - BIG-ENDIAN
     n = recv(socket, buffer, 2, MSG_WAITALL);
@@ -101,6 +152,7 @@ bool receiveCommand(int socket, std::string& command) {
         return false;
     }
 
+    if (frameObserver) frameObserver(socket, command.data(), command.length(), false, nowMicros() - started);
     return true;
 }
 
@@ -27,6 +27,62 @@ const size_t MAX_PAYLOAD_LENGTH = MAX_MESSAGE_LENGTH - HEADER_SIZE - MAX_HOPS_LE
  */
 bool sendCommand(int socket, const std::string& command);
 
+/**
+ * Called for every frame sendFrame()/sendCommand() sends or receiveCommand()
+ * receives, e.g. to keep per-connection statistics. Runs on the calling
+ * thread, so it must be cheap and must not send.
+ * 
+ * @param socket The socket the frame went over
+ * @param command Start of the command text (not NUL-terminated)
+ * @param length Command length
+ * @param outgoing true for sends
+ * @param elapsedUs Time spent inside send() for outgoing frames; for incoming
+ *                  ones, from the first byte of the frame to its last
+ */
+typedef void (*FrameObserver)(int socket, const char *command, size_t length, bool outgoing, uint64_t elapsedUs);
+
+/**
+ * Install the frame observer (nullptr to remove). Set it before starting threads.
+ */
+void setFrameObserver(FrameObserver observer);
+
+/**
+ * Send an already encoded frame (see encodeFrame), so a reply that many
+ * peers receive is framed once
+ * 
+ * @param socket The socket to send on
+ * @param frame The complete frame
+ * @return true if successful, false otherwise (also for an empty frame)
+ */
+bool sendFrame(int socket, const std::string& frame);
+
+/**
+ * Encode a command as a complete protocol frame
+ * <SOH><length><STX><command><ETX>
+ * 
+ * @param command The command string to frame
+ * @return The frame, or an empty string if the command is too long
+ */
+std::string encodeFrame(const std::string& command);
+
+/**
+ * Number of bytes still needed to complete the frame at the start of buffer.
+ * Lets non-blocking readers fetch exactly one frame without over-reading.
+ * 
+ * @param buffer Bytes received so far (starting at SOH)
+ * @return Bytes missing (0 when a full frame is buffered), or -1 if malformed
+ */
+int frameBytesNeeded(const std::string& buffer);
+
+/**
+ * Take one complete frame off the front of buffer
+ * 
+ * @param buffer Received bytes; the frame is removed on success
+ * @param command Output parameter - the command inside the frame
+ * @return 1 if a frame was extracted, 0 if more bytes are needed, -1 if malformed
+ */
+int extractFrame(std::string& buffer, std::string& command);
+
 /**
  * Receive a command from a socket.
  * This function will block until a complete message is received.
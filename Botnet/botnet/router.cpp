@@ -0,0 +1,235 @@
+#include "router.h"
+#include "protocol.h"
+#include <cstdlib>
+
+const int MAX_HOPS = 48;
+const size_t MAX_SEEN = 65536;  // Remembered messages; the oldest are forgotten first
+
+RouterCore::RouterCore(const std::string &groupId, RouterTransport transport, RouterClock clock)
+    : groupId(groupId), ttlSeconds(0), duplicateWindowSeconds(0), transport(transport),
+      clock(clock), total(0), version(1), statusVersion(0) {}
+
+void RouterCore::addPeer(int link, const std::string &group) {
+    peers[link] = group;
+    reports.erase(link);
+}
+
+void RouterCore::removePeer(int link) {
+    peers.erase(link);
+    reports.erase(link);
+}
+
+const std::map<std::string, int> *RouterCore::report(int link) const {
+    auto it = reports.find(link);
+    return it != reports.end() ? &it->second : nullptr;
+}
+
+void RouterCore::send(int link, OutgoingKind kind, const std::string &command, const Message *msg) {
+    Outgoing out = {link, kind, command, nullptr, msg ? *msg : Message()};
+    transport(out);
+}
+
+bool RouterCore::isExpired(const Message &msg, uint64_t nowUs) const {
+    return ttlSeconds > 0 && nowUs - msg.timestamp >= static_cast<uint64_t>(ttlSeconds) * 1000000;
+}
+
+// Remembers the message and reports whether it was already routed within the window
+bool RouterCore::seenBefore(const std::string &to, const std::string &from, const std::string &content,
+                            uint64_t nowUs) {
+    if (duplicateWindowSeconds <= 0) return false;
+    uint64_t windowUs = static_cast<uint64_t>(duplicateWindowSeconds) * 1000000;
+    while (!seenOrder.empty() && (nowUs - seenOrder.front().first >= windowUs || seenOrder.size() >= MAX_SEEN)) {
+        seen.erase(seenOrder.front().second);
+        seenOrder.pop_front();
+    }
+    size_t key = std::hash<std::string>()(to + '\0' + from + '\0' + content);
+    if (!seen.insert(key).second) return true;
+    seenOrder.push_back({nowUs, key});
+    return false;
+}
+
+void RouterCore::enqueue(const Message &msg) {
+    queues[msg.toGroup].push_back(msg);
+    noteQueued(msg);
+}
+
+void RouterCore::noteQueued(const Message &msg) {
+    total++;
+    version++;
+    if (onQueue) onQueue(MESSAGE_QUEUED, msg, msg.timestamp);
+    if (ttlSeconds > 0) expiryHeap.push({msg.timestamp + static_cast<uint64_t>(ttlSeconds) * 1000000, msg.toGroup});
+}
+
+bool RouterCore::dequeue(const std::string &group, Message &msg) {
+    auto it = queues.find(group);
+    if (it == queues.end()) return false;
+    std::deque<Message> &q = it->second;
+    uint64_t now = clock();
+    while (!q.empty()) {
+        msg = q.front();
+        q.pop_front();
+        total--;
+        version++;
+        bool live = !isExpired(msg, now);
+        if (onQueue) onQueue(live ? MESSAGE_DEQUEUED : MESSAGE_EXPIRED, msg, now);
+        if (live) return true;
+    }
+    return false;
+}
+
+void RouterCore::expire() {
+    uint64_t now = clock();
+    while (!expiryHeap.empty() && expiryHeap.top().deadline <= now) {
+        std::deque<Message> &q = queues[expiryHeap.top().group];
+        expiryHeap.pop();
+        while (!q.empty() && isExpired(q.front(), now)) {
+            if (onQueue) onQueue(MESSAGE_EXPIRED, q.front(), now);
+            q.pop_front();
+            total--;
+            version++;
+        }
+    }
+}
+
+size_t RouterCore::queuedFor(const std::string &group) const {
+    auto it = queues.find(group);
+    return it != queues.end() ? it->second.size() : 0;
+}
+
+void RouterCore::requeue(const Message &msg, bool flood) {
+    if (flood) {
+        enqueue(msg);
+        this->flood(msg);
+        return;
+    }
+    queues[msg.toGroup].push_front(msg);
+    noteQueued(msg);
+}
+
+// Copies to every peer that has not seen the message yet
+void RouterCore::flood(const Message &msg) {
+    for (const auto &p : peers)
+        if (!isInHops(msg.hops, p.second))
+            send(p.first, OUT_FLOOD, buildSENDMSG(msg.toGroup, msg.fromGroup, msg.content, msg.hops));
+}
+
+// STATUSRESP rebuilt only after a queue count changed
+std::shared_ptr<const std::string> RouterCore::statusFrame() {
+    if (statusVersion != version) {
+        std::vector<std::pair<std::string, int>> status;
+        for (const auto &p : queues)
+            if (!p.second.empty())
+                status.push_back({p.first, static_cast<int>(p.second.size())});
+        statusCommand = buildSTATUSRESP(status);
+        statusEncoded = std::make_shared<const std::string>(encodeFrame(statusCommand));
+        statusVersion = version;
+    }
+    return statusEncoded;
+}
+
+RouteResult RouterCore::routeSENDMSG(int link, const std::vector<std::string> &tokens, const std::string &hops) {
+    std::string to = tokens[1], from = tokens[2], content;
+    for (size_t i = 3; i < tokens.size(); i++) {
+        content += tokens[i];
+        if (i < tokens.size() - 1) content += ",";
+    }
+    uint64_t now = clock();
+
+    if (isInHops(hops, groupId)) return {ROUTE_LOOPED, {content, from, to, hops, now, 0}};
+    bool duplicate = seenBefore(to, from, content, now);
+
+    int hopCnt = 0;
+    if (!hops.empty()) {
+        hopCnt = 1;
+        for (char c : hops) if (c == ',') hopCnt++;
+    }
+
+    if (to == groupId) {
+        // Keep pulling while this peer still reports messages for us, duplicates included
+        auto rep = reports.find(link);
+        if (rep != reports.end()) {
+            auto forUs = rep->second.find(groupId);
+            if (forUs != rep->second.end() && forUs->second > 0 && --forUs->second > 0)
+                send(link, OUT_CONTROL, buildGETMSGS(groupId));
+        }
+    }
+    if (duplicate) return {ROUTE_DUPLICATE, {content, from, to, hops, now, hopCnt}};
+
+    if (hopCnt >= MAX_HOPS) {
+        Message msg = {content, from, to, "", now, 0};
+        enqueue(msg);
+        return {ROUTE_STORED, msg};
+    }
+
+    if (to == groupId) {
+        Message msg = {content, from, to, hops, now, hopCnt};
+        enqueue(msg);
+        return {ROUTE_DELIVERED, msg};
+    }
+
+    Message msg = {content, from, to, hops.empty() ? from : hops + "," + groupId, now, hopCnt + 1};
+    for (const auto &p : peers) {
+        if (p.second == to) {
+            send(p.first, OUT_FORWARD, buildSENDMSG(to, from, content, msg.hops), &msg);
+            return {ROUTE_FORWARDED, msg};
+        }
+    }
+    enqueue(msg);
+    flood(msg);
+    return {ROUTE_FLOODED, msg};
+}
+
+RouteResult RouterCore::handle(int link, const std::vector<std::string> &tokens, const std::string &hops) {
+    RouteResult handled = {ROUTE_HANDLED, Message()};
+    if (tokens.empty()) return {ROUTE_IGNORED, Message()};
+    const std::string &cmd = tokens[0];
+
+    if (cmd == "KEEPALIVE" && tokens.size() >= 2) {
+        if (atoi(tokens[1].c_str()) > 0) send(link, OUT_CONTROL, buildGETMSGS(groupId));
+        return handled;
+    }
+    if (cmd == "GETMSGS" && tokens.size() >= 2) {
+        Message msg;
+        if (dequeue(tokens[1], msg))
+            send(link, OUT_HANDOFF, buildSENDMSG(tokens[1], msg.fromGroup, msg.content, msg.hops), &msg);
+        else send(link, OUT_CONTROL, "NO_MESSAGES");
+        return handled;
+    }
+    if (cmd == "SENDMSG" && tokens.size() >= 4) return routeSENDMSG(link, tokens, hops);
+    if (cmd == "STATUSREQ") {
+        expire();
+        std::shared_ptr<const std::string> frame = statusFrame();
+        transport({link, OUT_CONTROL, statusCommand, frame, Message()});
+        return handled;
+    }
+    if (cmd == "STATUSRESP") {
+        std::map<std::string, int> &report = reports[link];
+        report.clear();
+        for (size_t i = 1; i + 1 < tokens.size(); i += 2) {
+            int cnt = atoi(tokens[i + 1].c_str());
+            if (!tokens[i].empty() && cnt > 0) report[tokens[i]] = cnt;
+        }
+        if (report.count(groupId)) send(link, OUT_CONTROL, buildGETMSGS(groupId));
+        return handled;
+    }
+    if (cmd == "NO_MESSAGES") {
+        auto rep = reports.find(link);
+        if (rep != reports.end()) rep->second.erase(groupId);
+        return handled;
+    }
+    return {ROUTE_IGNORED, Message()};
+}
+
+RouteAction RouterCore::originate(const std::string &to, const std::string &content) {
+    Message msg = {content, groupId, to, groupId, clock(), 1};
+    seenBefore(to, groupId, content, msg.timestamp);  // Only remembered, so copies flooded back are dropped
+    for (const auto &p : peers) {
+        if (p.second == to) {
+            send(p.first, OUT_FORWARD, buildSENDMSG(to, groupId, content, groupId), &msg);
+            return ROUTE_FORWARDED;
+        }
+    }
+    enqueue(msg);
+    flood(msg);
+    return ROUTE_FLOODED;
+}
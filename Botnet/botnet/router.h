@@ -0,0 +1,185 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <deque>
+#include <unordered_set>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+/**
+ * A message held for (or handed on towards) its destination group
+ */
+struct Message {
+    std::string content, fromGroup, toGroup, hops;
+    uint64_t timestamp;  // Router clock when the message reached us
+    int hopCount;
+};
+
+enum OutgoingKind {
+    OUT_CONTROL,  // Protocol reply or request
+    OUT_FLOOD,    // Copy of a queued message sent to every peer not yet in its hops
+    OUT_FORWARD,  // Message relayed straight to its destination group
+    OUT_HANDOFF   // Queued message handed to the peer that asked for it (GETMSGS)
+};
+
+/**
+ * A command for one peer link
+ */
+struct Outgoing {
+    int link;
+    OutgoingKind kind;
+    std::string command;
+    std::shared_ptr<const std::string> frame;  // Already encoded command, when the router caches it
+    Message message;                           // OUT_FORWARD and OUT_HANDOFF: the message handed on
+};
+
+enum RouteAction {
+    ROUTE_IGNORED,    // Not a routed command, or malformed
+    ROUTE_HANDLED,    // Control command answered
+    ROUTE_DELIVERED,  // SENDMSG for us, queued for our client
+    ROUTE_FORWARDED,  // SENDMSG relayed straight to a peer of its destination
+    ROUTE_FLOODED,    // SENDMSG queued and flooded to the other peers
+    ROUTE_STORED,     // SENDMSG over the hop limit, queued without relaying
+    ROUTE_LOOPED,     // SENDMSG already carried our group in its hops and was dropped
+    ROUTE_DUPLICATE   // SENDMSG we already routed over another path, dropped
+};
+
+struct RouteResult {
+    RouteAction action;
+    Message message;  // SENDMSG actions: the message as we route it
+};
+
+enum QueueEvent { MESSAGE_QUEUED, MESSAGE_DEQUEUED, MESSAGE_EXPIRED };
+
+/**
+ * Where the router's commands go. The server queues them and sends after
+ * releasing serverMutex; a simulator delivers them over virtual links.
+ */
+typedef std::function<void(const Outgoing &out)> RouterTransport;
+
+/**
+ * Current time in microseconds: monotonicMicros() in the server, virtual
+ * time in a simulator
+ */
+typedef std::function<uint64_t()> RouterClock;
+
+/**
+ * Routing and queueing for one node, independent of sockets and threads:
+ * decides what to do with each peer command (deliver, forward, flood,
+ * answer), holds the per-group message queues with TTL expiry, and
+ * tracks what each peer reported holding for us.
+ *
+ * A flooded message reaches a node once per path to it. With
+ * duplicateWindowSeconds set, the router remembers each message it routed
+ * (destination, sender and content) for that long and drops later copies,
+ * so a flood costs one frame per link instead of one per path. The protocol
+ * carries no message id, so this is only safe where content is unique (the
+ * simulator); it is off by default, and the server leaves it off so a
+ * client can send the same text twice.
+ *
+ * Peers are identified by an opaque link number (the socket in the
+ * server). Everything the router sends goes through the transport.
+ *
+ * Not thread-safe; the server uses it under serverMutex.
+ */
+class RouterCore {
+public:
+    RouterCore(const std::string &groupId, RouterTransport transport, RouterClock clock);
+
+    std::string groupId;
+    int ttlSeconds;  // Queued messages older than this are dropped; 0 keeps them forever
+    int duplicateWindowSeconds;  // How long a routed message is remembered; 0 (default) turns suppression off
+
+    /**
+     * Optional: called on every queue change, for metrics
+     */
+    std::function<void(QueueEvent event, const Message &msg, uint64_t nowUs)> onQueue;
+
+    /**
+     * A peer link now speaks for a group (HELO accepted or SERVERS received)
+     */
+    void addPeer(int link, const std::string &group);
+    void removePeer(int link);
+
+    /**
+     * Handle a command from a peer: KEEPALIVE, GETMSGS, SENDMSG, STATUSREQ,
+     * STATUSRESP and NO_MESSAGES. Anything else is left to the caller.
+     *
+     * @param link Peer the command came from
+     * @param tokens parseCommand() of the command without its hops
+     * @param hops Hops field of a SENDMSG (see parseSENDMSGWithHops)
+     */
+    RouteResult handle(int link, const std::vector<std::string> &tokens, const std::string &hops);
+
+    /**
+     * Route a message our own client sends: straight to a peer of its
+     * destination if there is one, otherwise queued and flooded.
+     * @return ROUTE_FORWARDED or ROUTE_FLOODED
+     */
+    RouteAction originate(const std::string &to, const std::string &content);
+
+    /**
+     * Take back a message whose send failed. A dequeued message (handoff or
+     * push) goes back to the front of its queue so per-group order holds; a
+     * direct forward was never queued, so it joins the back and is flooded
+     * to the other peers.
+     */
+    void requeue(const Message &msg, bool flood);
+
+    void enqueue(const Message &msg);
+
+    /**
+     * Pop the oldest live message for a group, dropping expired ones
+     */
+    bool dequeue(const std::string &group, Message &msg);
+
+    /**
+     * Drop expired messages; only touches queues whose earliest deadline has passed
+     */
+    void expire();
+
+    size_t queuedFor(const std::string &group) const;
+    size_t queued() const { return total; }
+
+    /**
+     * What a peer last reported holding (STATUSRESP): group -> messages, or null
+     */
+    const std::map<std::string, int> *report(int link) const;
+
+private:
+    // Min-heap entry: the group whose queue holds a message due at deadline
+    struct ExpiryEntry {
+        uint64_t deadline;
+        std::string group;
+        bool operator>(const ExpiryEntry &o) const { return deadline > o.deadline; }
+    };
+
+    bool isExpired(const Message &msg, uint64_t nowUs) const;
+    bool seenBefore(const std::string &to, const std::string &from, const std::string &content, uint64_t nowUs);
+    void send(int link, OutgoingKind kind, const std::string &command, const Message *msg = nullptr);
+    void flood(const Message &msg);
+    void noteQueued(const Message &msg);  // Bookkeeping for a message just added to its queue
+    RouteResult routeSENDMSG(int link, const std::vector<std::string> &tokens, const std::string &hops);
+    std::shared_ptr<const std::string> statusFrame();
+
+    RouterTransport transport;
+    RouterClock clock;
+    std::map<int, std::string> peers;  // Link -> group, in link order so floods are reproducible
+    std::map<std::string, std::deque<Message>> queues;
+    std::priority_queue<ExpiryEntry, std::vector<ExpiryEntry>, std::greater<ExpiryEntry>> expiryHeap;
+    std::map<int, std::map<std::string, int>> reports;
+    std::unordered_set<size_t> seen;                     // Hashes of recently routed messages
+    std::deque<std::pair<uint64_t, size_t>> seenOrder;   // (first seen, hash), oldest first
+    size_t total;
+    uint64_t version;                 // Bumped when any queue count changes
+    uint64_t statusVersion;
+    std::string statusCommand;        // STATUSRESP for statusVersion
+    std::shared_ptr<const std::string> statusEncoded;
+};
+
+#endif // ROUTER_H
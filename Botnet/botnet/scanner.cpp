@@ -1,16 +1,118 @@
 #include "scanner.h"
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <algorithm>
 #include <iostream>
 #include <cstring>
+#include <cerrno>
+#include <map>
+#include <time.h>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <pthread.h>
+
+static long long nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static long long nowMs()
+{
+    return nowUs() / 1000;
+}
+
+// Per-host RTT estimate, updated as in RFC 6298
+struct RttEstimate
+{
+    double srtt, rttvar;
+    bool sampled; // false until the first RTT sample
+    int backoff;  // RTO doublings since the last sample (RFC 6298 5.5)
+};
+
+static std::map<std::string, RttEstimate> rttCache;
+static pthread_mutex_t rttMutex = PTHREAD_MUTEX_INITIALIZER;
+
+const int DEFAULT_PROBE_TIMEOUT_MS = 250; // Until a host has RTT samples
+const int MIN_PROBE_TIMEOUT_MS = 50;      // Headroom for scheduling stalls on fast links
+const int MAX_PROBE_TIMEOUT_MS = 3000;
+
+// Caller holds rttMutex
+static int timeoutLocked(const RttEstimate &e)
+{
+    int timeout = DEFAULT_PROBE_TIMEOUT_MS;
+    if (e.sampled)
+    {
+        // RTO = SRTT + max(G, 4 * RTTVAR) with 1 ms granularity
+        double rto = e.srtt + std::max(1.0, 4 * e.rttvar);
+        timeout = std::min(MAX_PROBE_TIMEOUT_MS, std::max(MIN_PROBE_TIMEOUT_MS, (int)std::ceil(rto)));
+    }
+    return std::min(MAX_PROBE_TIMEOUT_MS, timeout << e.backoff);
+}
+
+void recordConnectRtt(const std::string &ip, double rttMs)
+{
+    pthread_mutex_lock(&rttMutex);
+    RttEstimate &e = rttCache[ip];
+    if (!e.sampled)
+    {
+        e.srtt = rttMs;
+        e.rttvar = rttMs / 2;
+        e.sampled = true;
+    }
+    else
+    {
+        e.rttvar = 0.75 * e.rttvar + 0.25 * std::fabs(e.srtt - rttMs);
+        e.srtt = 0.875 * e.srtt + 0.125 * rttMs;
+    }
+    e.backoff = 0;
+    pthread_mutex_unlock(&rttMutex);
+}
+
+void recordProbeTimeout(const std::string &ip, int timeoutMs)
+{
+    pthread_mutex_lock(&rttMutex);
+    RttEstimate &e = rttCache[ip];
+    int current = timeoutLocked(e);
+    // Probes sent under an older, shorter RTO already had their doubling
+    if (timeoutMs >= current && current < MAX_PROBE_TIMEOUT_MS)
+        e.backoff++;
+    pthread_mutex_unlock(&rttMutex);
+}
+
+int probeTimeoutFor(const std::string &ip)
+{
+    pthread_mutex_lock(&rttMutex);
+    auto it = rttCache.find(ip);
+    int timeout = it != rttCache.end() ? timeoutLocked(it->second) : DEFAULT_PROBE_TIMEOUT_MS;
+    pthread_mutex_unlock(&rttMutex);
+    return timeout;
+}
+
+bool synRetransmitted(int sock)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+        return true; // Unknown: do not trust the sample
+    return info.tcpi_total_retrans > 0;
+}
 
 bool isPortOpen(const std::string &ip, int port, int timeout_ms)
 {
+    if (timeout_ms < 0)
+        timeout_ms = probeTimeoutFor(ip);
+
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0)
         return false;
@@ -26,6 +128,7 @@ bool isPortOpen(const std::string &ip, int port, int timeout_ms)
     inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr);
 
     // Try to connect (will return immediately)
+    long long started = nowUs();
     connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
 
     // Wait for connection with timeout
@@ -34,119 +137,411 @@ bool isPortOpen(const std::string &ip, int port, int timeout_ms)
     FD_SET(sock, &writefds);
 
     struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = timeout_ms * 1000;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
 
     bool isOpen = false;
-    if (select(sock + 1, NULL, &writefds, NULL, &timeout) > 0)
+    int ready = select(sock + 1, NULL, &writefds, NULL, &timeout);
+    if (ready > 0)
     {
         int error;
         socklen_t len = sizeof(error);
         getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len);
         isOpen = (error == 0);
+        // A SYN-ACK or a RST are both one round trip, unless the SYN was resent (Karn)
+        if ((error == 0 || error == ECONNREFUSED) && !synRetransmitted(sock))
+            recordConnectRtt(ip, (nowUs() - started) / 1000.0);
+    }
+    else if (ready == 0)
+    {
+        recordProbeTimeout(ip, timeout_ms);
     }
 
     close(sock);
     return isOpen;
 }
 
-std::vector<int> scanForServers(const std::string &ip, int startPort,
-                                int endPort, int myPort)
+void sweepPorts(const std::string &ip, const std::vector<int> &ports, int maxInFlight,
+                int timeout_ms, const std::function<void(int port, bool open)> &onResult)
 {
-    std::vector<int> openPorts;
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr) <= 0)
+    {
+        for (int port : ports)
+            onResult(port, false);
+        return;
+    }
 
-    std::cout << "[SCAN] Scanning ports " << startPort << "-" << endPort << std::endl;
+    int ep = epoll_create1(0);
+    if (ep < 0)
+    {
+        for (int port : ports)
+            onResult(port, isPortOpen(ip, port, timeout_ms));
+        return;
+    }
 
-    for (int port = startPort; port <= endPort; port++)
+    struct Probe
+    {
+        int port;
+        long long started, deadline;
+        int timeout;
+    };
+    std::map<int, Probe> inFlight; // fd -> probe
+    size_t next = 0;
+
+    auto finish = [&](int fd, bool open)
     {
-        if (port == myPort)
+        int port = inFlight[fd].port;
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+        inFlight.erase(fd);
+        onResult(port, open);
+    };
+
+    while (next < ports.size() || !inFlight.empty())
+    {
+        // Top up to the in-flight limit
+        while (next < ports.size() && (int)inFlight.size() < maxInFlight)
+        {
+            int port = ports[next++];
+            int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (sock < 0)
+            {
+                // Out of descriptors: retry once something finishes
+                next--;
+                break;
+            }
+            serv_addr.sin_port = htons(port);
+            if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 && errno != EINPROGRESS)
+            {
+                close(sock);
+                onResult(port, false);
+                continue;
+            }
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT;
+            ev.data.fd = sock;
+            epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+            // Auto timeouts are re-read per probe, so early replies tighten later deadlines
+            long long started = nowUs();
+            int timeout = timeout_ms < 0 ? probeTimeoutFor(ip) : timeout_ms;
+            inFlight[sock] = {port, started, started / 1000 + timeout, timeout};
+        }
+        if (inFlight.empty())
         {
-            continue; // Skip our own port
+            if (next < ports.size())
+                onResult(ports[next++], false); // Could not even open a socket
+            continue;
         }
 
-        if (isPortOpen(ip, port, 200))
+        long long now = nowMs(), soonest = now + MAX_PROBE_TIMEOUT_MS;
+        for (const auto &p : inFlight)
+            soonest = std::min(soonest, p.second.deadline);
+
+        struct epoll_event events[256];
+        int n = epoll_wait(ep, events, 256, soonest > now ? (int)(soonest - now) : 0);
+        for (int i = 0; i < n; i++)
         {
-            std::cout << "[SCAN] Found server on port " << port << std::endl;
-            openPorts.push_back(port);
+            int fd = events[i].data.fd;
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if ((error == 0 || error == ECONNREFUSED) && !synRetransmitted(fd))
+                recordConnectRtt(ip, (nowUs() - inFlight[fd].started) / 1000.0);
+            finish(fd, error == 0);
         }
 
-        // Progress indicator
-        if ((port - startPort) % 20 == 0)
+        now = nowMs();
+        std::vector<int> expired;
+        for (const auto &p : inFlight)
+            if (p.second.deadline <= now)
+                expired.push_back(p.first);
+        for (int fd : expired)
         {
-            std::cout << "[SCAN] Progress: " << port << "/" << endPort << std::endl;
+            recordProbeTimeout(ip, inFlight[fd].timeout);
+            finish(fd, false);
         }
     }
+    close(ep);
+}
 
-    std::cout << "[SCAN] Complete. Found " << openPorts.size() << " servers" << std::endl;
-    return openPorts;
+bool synScanAvailable()
+{
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (sock < 0)
+        return false;
+    close(sock);
+    return true;
 }
 
-std::vector<int> selectNeighbors(const std::vector<int> &allPorts,
-                                 int myPort, int maxConnections)
+static uint16_t checksum(const uint16_t *data, size_t len, uint32_t sum = 0)
 {
-    std::vector<int> selected;
+    for (; len > 1; len -= 2)
+        sum += *data++;
+    if (len == 1)
+        sum += *(const uint8_t *)data;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
 
-    // Cast to avoid comparison warnings
-    if (allPorts.size() <= static_cast<size_t>(maxConnections))
+// Source address the kernel would use to reach ip
+static bool sourceAddressFor(const struct sockaddr_in &dst, struct in_addr &src)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return false;
+    struct sockaddr_in probe = dst;
+    probe.sin_port = htons(53);
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    bool ok = connect(sock, (struct sockaddr *)&probe, sizeof(probe)) == 0 &&
+              getsockname(sock, (struct sockaddr *)&local, &len) == 0;
+    close(sock);
+    if (ok)
+        src = local.sin_addr;
+    return ok;
+}
+
+bool synSweepPorts(const std::string &ip, const std::vector<int> &ports, int ratePerSec,
+                   int timeout_ms, const std::function<void(int port, bool open)> &onResult)
+{
+    struct sockaddr_in dst;
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    if (inet_pton(AF_INET, ip.c_str(), &dst.sin_addr) <= 0)
+        return false;
+    struct in_addr src;
+    if (!sourceAddressFor(dst, src))
+        return false;
+
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (sock < 0)
+        return false; // Not privileged
+
+    // Reserve our source port with a bound (never listening) TCP socket, so the
+    // kernel neither hands it to another connection nor has a live socket on it
+    // whose traffic we could mistake for replies; it still RSTs the SYN-ACKs
+    int reserved = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr = src;
+    socklen_t localLen = sizeof(local);
+    if (reserved < 0 || bind(reserved, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        getsockname(reserved, (struct sockaddr *)&local, &localLen) < 0)
     {
-        // Connect to all if we have maxConnections or fewer
-        return allPorts;
+        if (reserved >= 0)
+            close(reserved);
+        close(sock);
+        return false;
     }
+    uint16_t srcPort = ntohs(local.sin_port);
+
+    std::mt19937 rng(std::random_device{}());
+    uint32_t isn = rng();
 
-    // Separate into ports below and above us
-    std::vector<int> portsBelow;
-    std::vector<int> portsAbove;
+    // Pseudo-header for the TCP checksum
+    struct
+    {
+        uint32_t src, dst;
+        uint8_t zero, proto;
+        uint16_t len;
+    } pseudo = {src.s_addr, dst.sin_addr.s_addr, 0, IPPROTO_TCP, htons(sizeof(struct tcphdr))};
+
+    std::map<int, long long> pending; // port -> when its SYN went out (us), 0 = not yet sent
+    for (int port : ports)
+        pending[port] = 0;
 
-    for (int port : allPorts)
+    auto report = [&](int port, bool open)
     {
-        if (port < myPort)
+        auto it = pending.find(port);
+        if (it == pending.end())
+            return;
+        pending.erase(it);
+        onResult(port, open);
+    };
+
+    long long gapUs = ratePerSec > 0 ? 1000000LL / ratePerSec : 0;
+    long long nextSendUs = nowUs();
+    long long deadline = -1;
+    int timeoutUsed = 0;
+    size_t next = 0;
+
+    while (!pending.empty())
+    {
+        long long nowUsec = nowUs();
+        if (next < ports.size() && nowUsec >= nextSendUs)
         {
-            portsBelow.push_back(port);
+            struct tcphdr tcp;
+            memset(&tcp, 0, sizeof(tcp));
+            tcp.source = htons(srcPort);
+            tcp.dest = htons(ports[next]);
+            tcp.seq = htonl(isn);
+            tcp.doff = sizeof(tcp) / 4;
+            tcp.syn = 1;
+            tcp.window = htons(1024);
+            uint32_t partial = ~checksum((const uint16_t *)&pseudo, sizeof(pseudo)) & 0xFFFF;
+            tcp.check = checksum((const uint16_t *)&tcp, sizeof(tcp), partial);
+
+            dst.sin_port = htons(ports[next]);
+            pending[ports[next]] = nowUs();
+            if (sendto(sock, &tcp, sizeof(tcp), 0, (struct sockaddr *)&dst, sizeof(dst)) < 0)
+                report(ports[next], false);
+            next++;
+            nextSendUs += gapUs;
+            if (next == ports.size())
+            {
+                timeoutUsed = timeout_ms < 0 ? probeTimeoutFor(ip) : timeout_ms;
+                deadline = nowMs() + timeoutUsed;
+            }
+            continue;
         }
-        else if (port > myPort)
+
+        // Microsecond waits: at more than 1000 SYNs/s a millisecond poll() would round to 0 and spin
+        long long waitUs = next < ports.size() ? nextSendUs - nowUsec : deadline * 1000 - nowUsec;
+        if (next == ports.size() && waitUs <= 0)
+            break;
+        waitUs = std::max(0LL, waitUs);
+        struct timespec wait = {(time_t)(waitUs / 1000000), (long)(waitUs % 1000000) * 1000};
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (ppoll(&pfd, 1, &wait, NULL) <= 0)
+            continue;
+
+        // Raw TCP sockets deliver the IP header too
+        unsigned char buf[1500];
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n < (ssize_t)sizeof(struct iphdr))
+            continue;
+        const struct iphdr *iph = (const struct iphdr *)buf;
+        size_t ipLen = iph->ihl * 4;
+        if (iph->saddr != dst.sin_addr.s_addr || n < (ssize_t)(ipLen + sizeof(struct tcphdr)))
+            continue;
+        const struct tcphdr *reply = (const struct tcphdr *)(buf + ipLen);
+        if (ntohs(reply->dest) != srcPort)
+            continue; // Not ours (on loopback this includes our own SYNs)
+
+        int port = ntohs(reply->source);
+        auto sent = pending.find(port);
+        if (sent != pending.end() && sent->second > 0 && (reply->rst || reply->syn))
+            recordConnectRtt(ip, (nowUs() - sent->second) / 1000.0);
+        if (reply->syn && reply->ack && ntohl(reply->ack_seq) == isn + 1)
+            report(port, true);
+        else if (reply->rst)
+            report(port, false);
+    }
+
+    // Anything left never answered: filtered
+    std::vector<int> silent;
+    for (const auto &p : pending)
+        silent.push_back(p.first);
+    if (!silent.empty() && deadline >= 0)
+        recordProbeTimeout(ip, timeoutUsed);
+    for (int port : silent)
+        report(port, false);
+    close(reserved);
+    close(sock);
+    return true;
+}
+
+std::vector<int> scanForServers(const std::string &ip, int startPort,
+                                int endPort, int myPort, bool synScan)
+{
+    std::vector<int> openPorts;
+    std::vector<int> ports;
+    for (int port = startPort; port <= endPort; port++)
+    {
+        if (port != myPort) // Skip our own port
         {
-            portsAbove.push_back(port);
+            ports.push_back(port);
         }
     }
 
-    // Sort: closest first
-    std::sort(portsBelow.begin(), portsBelow.end(), std::greater<int>()); // Descending
-    std::sort(portsAbove.begin(), portsAbove.end());                      // Ascending
-
-    // Take half from each side
-    int halfMax = maxConnections / 2;
+    std::cout << "[SCAN] Scanning ports " << startPort << "-" << endPort << std::endl;
+    long long started = nowMs();
 
-    // Add closest below
-    for (size_t i = 0; i < portsBelow.size() && i < static_cast<size_t>(halfMax); i++)
+    auto collect = [&](int port, bool open)
+    {
+        if (open)
+        {
+            std::cout << "[SCAN] Found server on port " << port << std::endl;
+            openPorts.push_back(port);
+        }
+    };
+    if (synScan && synSweepPorts(ip, ports, 2000, -1, collect))
+    {
+        std::cout << "[SCAN] Used SYN scan" << std::endl;
+    }
+    else
     {
-        selected.push_back(portsBelow[i]);
+        if (synScan)
+            std::cout << "[SCAN] SYN scan needs CAP_NET_RAW, using connect probes" << std::endl;
+        sweepPorts(ip, ports, 256, -1, collect);
     }
+    std::sort(openPorts.begin(), openPorts.end());
+
+    std::cout << "[SCAN] Complete. Found " << openPorts.size() << " servers in "
+              << (nowMs() - started) << "ms" << std::endl;
+    return openPorts;
+}
 
-    // Add closest above
-    for (size_t i = 0; i < portsAbove.size() && i < static_cast<size_t>(halfMax); i++)
+double latencyScore(const NeighborMetrics &m, int myPort)
+{
+    (void)myPort;
+    double score = 0;
+    score -= (m.connectRttMs >= 0 ? m.connectRttMs : 100) / 10;   // -1 per 10 ms of RTT
+    score -= (m.heloLatencyMs >= 0 ? m.heloLatencyMs : 500) / 100; // -1 per 100 ms to answer HELO
+    score += 10 * (m.deliveryRate >= 0 ? m.deliveryRate : 0.5);
+    if (m.throughputBps > 0)
     {
-        selected.push_back(portsAbove[i]);
+        score += std::log10(1 + m.throughputBps);
     }
+    return score;
+}
 
-    // Fill remaining slots if one side had fewer than halfMax
-    if (selected.size() < static_cast<size_t>(maxConnections))
+double proximityScore(const NeighborMetrics &m, int myPort)
+{
+    return -std::abs(m.port - myPort);
+}
+
+NeighborScorer neighborScorerByName(const std::string &name)
+{
+    if (name == "latency")
+    {
+        return latencyScore;
+    }
+    if (name == "port")
     {
-        int remaining = maxConnections - selected.size();
+        return proximityScore;
+    }
+    return NeighborScorer();
+}
 
-        // Add more from below
-        for (size_t i = halfMax; i < portsBelow.size() && remaining > 0; i++)
+std::vector<NeighborMetrics> selectNeighbors(const std::vector<NeighborMetrics> &candidates, int myPort,
+                                             int maxConnections, const NeighborScorer &score)
+{
+    // Score once, then order best first; port proximity breaks ties
+    std::vector<std::pair<double, size_t>> ranked;
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        ranked.push_back({score(candidates[i], myPort), i});
+    }
+    std::sort(ranked.begin(), ranked.end(), [&](const std::pair<double, size_t> &a, const std::pair<double, size_t> &b)
+    {
+        if (a.first != b.first)
         {
-            selected.push_back(portsBelow[i]);
-            remaining--;
+            return a.first > b.first;
         }
+        return std::abs(candidates[a.second].port - myPort) < std::abs(candidates[b.second].port - myPort);
+    });
 
-        // Add more from above
-        for (size_t i = halfMax; i < portsAbove.size() && remaining > 0; i++)
-        {
-            selected.push_back(portsAbove[i]);
-            remaining--;
-        }
+    std::vector<NeighborMetrics> selected;
+    for (size_t i = 0; i < ranked.size() && selected.size() < static_cast<size_t>(std::max(0, maxConnections)); i++)
+    {
+        selected.push_back(candidates[ranked[i].second]);
     }
-
     return selected;
-}
\ No newline at end of file
+}
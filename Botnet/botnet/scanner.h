@@ -3,15 +3,85 @@
 
 #include <string>
 #include <vector>
+#include <functional>
+
+/**
+ * Feed a measured connect round trip (SYN-ACK or RST) into the host's
+ * RTT estimate. SRTT and RTTVAR are smoothed as TCP does (RFC 6298).
+ * @param ip Host the sample belongs to
+ * @param rttMs Measured round trip in milliseconds
+ */
+void recordConnectRtt(const std::string &ip, double rttMs);
+
+/**
+ * Note that a probe to the host got no answer within timeoutMs. Doubles the
+ * host's timeout (RFC 6298 5.5, capped at 3000 ms) until the next RTT sample;
+ * a probe that was sent under an earlier, shorter timeout does not double it
+ * again, so a batch of probes lost together backs off once.
+ * @param ip Host the probe went to
+ * @param timeoutMs Timeout the probe was sent with
+ */
+void recordProbeTimeout(const std::string &ip, int timeoutMs);
+
+/**
+ * Probe timeout for a host: SRTT + 4 * RTTVAR, clamped to 50..3000 ms,
+ * or 250 ms while the host has no samples yet; doubled per backoff
+ * @param ip Host to probe
+ * @return Timeout in milliseconds
+ */
+int probeTimeoutFor(const std::string &ip);
+
+/**
+ * Whether the kernel resent anything on a connecting or connected socket.
+ * Karn's rule: a round trip measured across a retransmitted SYN is
+ * ambiguous and must not be fed to recordConnectRtt().
+ */
+bool synRetransmitted(int sock);
 
 /**
  * Check if a port is open on given IP address
  * @param ip IP address to check
  * @param port Port number to check
- * @param timeout_ms Timeout in milliseconds
+ * @param timeout_ms Timeout in milliseconds, or -1 to derive it from the host's RTT
  * @return true if port is open, false otherwise
  */
-bool isPortOpen(const std::string &ip, int port, int timeout_ms = 500);
+bool isPortOpen(const std::string &ip, int port, int timeout_ms = -1);
+
+/**
+ * Probe many ports at once: non-blocking connects are kept in flight up to
+ * maxInFlight and waited on with epoll, each with its own deadline.
+ * A whole range finishes in about one timeout instead of one per port.
+ * @param ip IP address to probe
+ * @param ports Ports to probe
+ * @param maxInFlight Maximum concurrent probes
+ * @param timeout_ms Deadline for each probe in milliseconds, or -1 to derive it from the host's RTT
+ * @param onResult Called as each probe finishes, in completion order
+ */
+void sweepPorts(const std::string &ip, const std::vector<int> &ports, int maxInFlight,
+                int timeout_ms, const std::function<void(int port, bool open)> &onResult);
+
+/**
+ * Check whether a raw-socket SYN scan is possible (needs CAP_NET_RAW)
+ * @return true if a raw TCP socket can be opened
+ */
+bool synScanAvailable();
+
+/**
+ * Half-open SYN scan from a single raw socket.
+ * Sends bare SYNs at a fixed rate and classifies replies: SYN-ACK means
+ * open, RST means closed, silence until the deadline means filtered.
+ * No connection is ever completed (our kernel answers the SYN-ACK with a
+ * RST), so the target sees no accepted connection and no socket is spent
+ * per probe.
+ * @param ip IP address to probe
+ * @param ports Ports to probe
+ * @param ratePerSec SYNs sent per second
+ * @param timeout_ms How long to wait for replies after the last SYN, or -1 for RTT-derived
+ * @param onResult Called once per port as replies arrive (or at the deadline)
+ * @return false if not privileged; onResult is not called in that case
+ */
+bool synSweepPorts(const std::string &ip, const std::vector<int> &ports, int ratePerSec,
+                   int timeout_ms, const std::function<void(int port, bool open)> &onResult);
 
 /**
  * Scan a range of ports for open servers
@@ -19,19 +89,59 @@ bool isPortOpen(const std::string &ip, int port, int timeout_ms = 500);
  * @param startPort Starting port number
  * @param endPort Ending port number
  * @param myPort Our own port (to skip)
- * @return Vector of open port numbers
+ * @param synScan Use a SYN scan when privileged, else fall back to connect probes
+ * @return Vector of open port numbers, ascending
  */
 std::vector<int> scanForServers(const std::string &ip, int startPort,
-                                int endPort, int myPort);
+                                int endPort, int myPort, bool synScan = false);
+
+/**
+ * What we have measured about one neighbor (current or potential).
+ * Negative values mean "not measured yet"; scorers substitute a prior.
+ */
+struct NeighborMetrics {
+    std::string ip;
+    int port;
+    double connectRttMs;    // TCP connect time
+    double heloLatencyMs;   // From connect until their SERVERS reply
+    double throughputBps;   // Bytes per second received while connected
+    double deliveryRate;    // Fraction of our sends to them that went through (0..1)
+};
+
+/**
+ * Ranks a neighbor; higher is better
+ */
+typedef std::function<double(const NeighborMetrics &m, int myPort)> NeighborScorer;
+
+/**
+ * Default scorer: low connect RTT and HELO latency, reliable delivery,
+ * some credit for throughput. Unmeasured values get middling priors so
+ * a measured good peer beats an unknown one and an unknown one beats a
+ * measured bad one.
+ */
+double latencyScore(const NeighborMetrics &m, int myPort);
+
+/**
+ * Legacy scorer: closest port number first
+ */
+double proximityScore(const NeighborMetrics &m, int myPort);
+
+/**
+ * Look up a built-in scorer ("latency" or "port")
+ * @return The scorer, or an empty function for an unknown name
+ */
+NeighborScorer neighborScorerByName(const std::string &name);
 
 /**
- * Select closest neighbors based on port proximity
- * @param allPorts All discovered open ports
+ * Select the best neighbors by score
+ * @param candidates Neighbors to choose from, with their metrics
  * @param myPort Our listening port
  * @param maxConnections Maximum connections to maintain (default 8)
- * @return Vector of selected port numbers
+ * @param score How to rank candidates (default latencyScore)
+ * @return Up to maxConnections candidates, best first
  */
-std::vector<int> selectNeighbors(const std::vector<int> &allPorts,
-                                 int myPort, int maxConnections = 8);
+std::vector<NeighborMetrics> selectNeighbors(const std::vector<NeighborMetrics> &candidates, int myPort,
+                                             int maxConnections = 8,
+                                             const NeighborScorer &score = latencyScore);
 
 #endif // SCANNER_H
\ No newline at end of file
@@ -1,5 +1,17 @@
 #include "protocol.h"
 #include "scanner.h"
+#include "timerwheel.h"
+#include "failuredetect.h"
+#include "connmgr.h"
+#include "handshake.h"
+#include "discovery.h"
+#include "snapshot.h"
+#include "directory.h"
+#include "metrics.h"
+#include "peerstats.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "router.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,23 +23,43 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <queue>
 #include <vector>
 #include <set>
 #include <pthread.h>
 #include <algorithm>
 #include <signal.h>
+#include <random>
+#include <memory>
 
-const std::string MY_GROUP_ID = "A5_1";
+std::string MY_GROUP_ID = "A5_1";  // --group=<id> for local multi-node runs
 const std::string TSAM_SERVER_IP = "130.208.246.98";
 const std::vector<int> INSTRUCTOR_PORTS = {5001, 5002, 5003};
-const int MAX_HOPS = 48;
+const int PUSH_DELAY_MS = 500;    // Let the peer finish its handshake before we push
+const int PUSH_PACING_MS = 50;    // Gap between pushed frames so the link stays responsive
+const int DEFAULT_MESSAGE_TTL = 3600;  // Seconds a queued message may wait (--ttl=<sec>, 0 = forever)
 
-struct Message {
-    std::string content, fromGroup, toGroup, hops;
-    time_t timestamp;
-    int hopCount;
-};
+// Timer wheel resolution and periodic intervals (seconds)
+const int TIMER_TICK_MS = 100;
+const int KEEPALIVE_INTERVAL = 60;
+const int STATUSREQ_INTERVAL = 180;
+const int PEER_IDLE_TIMEOUT = 300;
+const int STATUS_LOG_INTERVAL = 30;
+const int MANAGER_IDLE_WAIT = 30;     // Connection manager recheck when nothing happens
+const int SCAN_INTERVAL = 120;        // Sweeps while below minPeers skip ports checked within this
+const int DISCOVERY_BATCH = 16;       // Ports per background discovery batch (--scan)
+const int DISCOVERY_BATCH_INTERVAL_MS = 10000;
+const int HANDSHAKE_TIMEOUT_MS = 10000;   // Whole connect + HELO + SERVERS exchange
+const int DEFAULT_DETECT_SECONDS = 30;  // Dead-peer detection budget (--detect=<sec>)
+const int NEIGHBOR_REEVAL_INTERVAL = 300; // How often the peer set is re-scored
+const double NEIGHBOR_SWAP_MARGIN = 2.0;  // Score a candidate must win by to replace a peer
+const int SNAPSHOT_INTERVAL = 60;          // Known servers are saved this often and at shutdown
+const int SNAPSHOT_MAX_AGE = 24 * 3600;    // Older snapshot entries are not loaded
+const int DIRECTORY_CAPACITY = 512;        // Known servers kept; the stalest, least reliable go first
+const int PEER_TCP_SAMPLE_INTERVAL = 10;   // How often TCP_INFO is read for every peer
+const std::string OTHER_GROUPS = "(other)";  // Latency bucket for groups we do not know
 
 struct ServerInfo {
     int socket;
@@ -35,26 +67,105 @@ struct ServerInfo {
     int port;
     time_t lastSeen, connectedSince;
     bool isOutgoing, isInstructor;
+    unsigned long connId;  // Distinguishes connections that reuse the same socket number
+    uint64_t handshakeMs;  // Connect/accept until the HELO exchange completed
 };
 
-struct KnownServer {
-    std::string groupId, ip;
-    int port;
-    time_t lastHeard;
+// Per destination group: how long its messages wait and how long until they are handed on
+struct GroupLatency {
+    Histogram residence;  // Enqueue until dequeued
+    Histogram delivery;   // Receipt until handed to the next hop or client, queued or not
+};
+
+// What the router decided, taken under serverMutex. Each handed-on message's histograms
+// are resolved then, so sending records its delivery without the lock.
+struct OutboxBatch {
+    std::vector<Outgoing> out;
+    std::vector<std::shared_ptr<GroupLatency>> latency;  // Parallel to out; null for control and flood
+};
+
+// A reply encoded once and shared by every send until what it describes changes
+struct CachedFrame {
+    uint64_t version;   // Source version the frame was built from
+    std::string command;
+    std::shared_ptr<const std::string> frame;
+};
+
+// Measurements per ip:port, kept across reconnects so a redial can be judged
+struct NeighborStats {
+    NeighborMetrics metrics;
+    uint64_t bytesIn;          // Received on the current connection
+    int sendsOk, sendsFailed;  // Sends of closed connections and failure-detector drops; live ones are in peerStats()
+    int dialsOk, dialsFailed;  // Outbound handshakes
 };
 
 void* peerCommunicationThread(void* arg);
+void onPeerRegistered(int sock, const std::string &groupId);
+void schedulePeerTimers(int sock, unsigned long connId);
+void onPortFound(const std::string &ip, int port);
 
 std::map<int, ServerInfo> connectedServers;
-std::vector<KnownServer> knownServers;
+ServerDirectory directory(DIRECTORY_CAPACITY);  // Servers we know of, connected or not
 std::set<std::string> connectedGroupIds;
-std::map<std::string, std::queue<Message>> messageQueue;
+// Commands the router decided on. Whoever calls the router takes them (takeOutboxLocked)
+// before releasing serverMutex and sends them after.
+std::vector<Outgoing> outbox;
+RouterCore router(MY_GROUP_ID, [](const Outgoing &out) { outbox.push_back(out); }, monotonicMicros);
+std::map<int, ProbeState> peerProbes;  // Only used with --probe
+int detectSeconds = DEFAULT_DETECT_SECONDS;
+bool probeEnabled = false;
 std::ofstream logFile;
 int listenPort;
 std::string myIpAddress;
-pthread_mutex_t serverMutex = PTHREAD_MUTEX_INITIALIZER;
-bool isScanning = false;
-int messagesReceived = 0, messagesSent = 0, messagesForwarded = 0, loopsDetected = 0;
+ProfiledMutex serverMutex;  // PROFILED_LOCK/UNLOCK; --lock-profile records contention per call site
+TimerWheel timers(TIMER_TICK_MS, monotonicMillis());
+unsigned long nextConnId = 1;
+pthread_cond_t connCond = PTHREAD_COND_INITIALIZER;  // Signals the connection manager
+ConnectionManager connManager({3, 8, 6, 2});
+// --scan turns on continuous background discovery, --syn-scan half-open probes
+DiscoveryService discovery({DISCOVERY_BATCH, DISCOVERY_BATCH_INTERVAL_MS, SCAN_INTERVAL * 1000, false, false}, onPortFound);
+std::map<std::string, NeighborStats> neighborStats;
+// Directory entries as dial candidates (ip:port), kept current from directory.changedSince()
+std::unordered_map<std::string, DialCandidate> candidateCache;
+uint64_t candidateVersion = 0;               // Directory version candidateCache reflects
+std::unordered_set<std::string> rescoreKeys;  // ip:port whose neighbor stats changed since the last score
+NeighborScorer neighborScorer = latencyScore;  // --neighbor-score=latency|port
+std::string snapshotPath = MY_GROUP_ID + "_peers.snapshot";  // --no-snapshot clears it
+std::string tracePath = MY_GROUP_ID + "_trace.json";  // Written by TRACE and SIGUSR1 when --trace is on
+bool offline = false;  // --offline: no instructor dials or course port discovery (loopback test meshes)
+uint64_t membershipVersion = 1;  // Bumped when connectedServers changes in a way SERVERS can see
+CachedFrame serversCache = {0, "", nullptr};
+
+// Metrics (STATS client command, --metrics-port). Recording them takes no locks.
+Counter messagesReceived("messages_received_total", "SENDMSG frames addressed to us");
+Counter messagesSent("messages_sent_total", "Client messages delivered straight to a connected group");
+Counter messagesForwarded("messages_forwarded_total", "Messages relayed to a direct peer, backlog pushes included");
+Counter loopsDetected("loops_detected_total", "SENDMSG dropped because we were already in its hops");
+Counter duplicatesDropped("duplicates_dropped_total", "SENDMSG dropped because we already routed it over another path");
+Counter messagesExpired("messages_expired_total", "Queued messages dropped after their TTL");
+Counter framesReceived("peer_frames_received_total", "Frames received from peers");
+Counter framesSent("frames_sent_total", "Frames sent to peers and clients");
+Counter clientCommands("client_commands_total", "Commands received from clients");
+Gauge messagesQueued("messages_queued", "Messages waiting in the queues");
+Histogram handlerTime("peer_handler_us", "Time to handle one frame from a peer");
+Histogram queueResidence("queue_residence_us", "Time a message spent queued before it was handed out");
+Histogram deliveryTime("message_delivery_us", "Receipt of a message until it was handed to the next hop or client");
+std::map<std::string, std::shared_ptr<GroupLatency>> groupLatency;  // groupLatencyLocked() bounds it
+std::map<int, uint64_t> deliveredByHops;  // Messages for us by hop count (STATS); guarded by serverMutex
+Histogram sendTime("message_send_us", "Time to hand one relayed message to the kernel");
+GaugeFn connectedPeersGauge("connected_peers", "Direct peer connections", [] {
+    PROFILED_LOCK(serverMutex);
+    int64_t n = connectedServers.size();
+    PROFILED_UNLOCK(serverMutex);
+    return n;
+});
+GaugeFn knownServersGauge("known_servers", "Servers in the directory", [] {
+    PROFILED_LOCK(serverMutex);
+    int64_t n = directory.size();
+    PROFILED_UNLOCK(serverMutex);
+    return n;
+});
+GaugeFn timersGauge("timers_pending", "Timers on the wheel", [] { return (int64_t)timers.pending(); });
 
 std::map<std::string, time_t> lastHeloAttempt;
 
@@ -64,6 +175,57 @@ void logMessage(const std::string &msg) {
     if (logFile.is_open()) { logFile << entry << std::endl; logFile.flush(); }
 }
 
+// Caller holds serverMutex. Only groups we know (ours, a peer's or one in the directory)
+// get their own histograms; any other group a peer names shares OTHER_GROUPS, so SENDMSG
+// to made-up groups cannot grow the map.
+std::shared_ptr<GroupLatency> groupLatencyLocked(const std::string &groupId) {
+    bool known = groupId == MY_GROUP_ID || connectedGroupIds.count(groupId) || directory.findByGroup(groupId);
+    std::shared_ptr<GroupLatency> &g = groupLatency[known ? groupId : OTHER_GROUPS];
+    if (!g) g = std::make_shared<GroupLatency>();
+    return g;
+}
+
+// Caller holds serverMutex. Drops a group's histograms once we no longer know it.
+void forgetGroupLatencyLocked(const std::string &groupId) {
+    if (groupId == MY_GROUP_ID || connectedGroupIds.count(groupId) || directory.findByGroup(groupId)) return;
+    groupLatency.erase(groupId);
+}
+
+// Caller holds serverMutex (the router calls it on every queue change)
+void onQueueEvent(QueueEvent event, const Message &msg, uint64_t nowUs) {
+    if (event == MESSAGE_QUEUED) {
+        messagesQueued.add(1);
+        return;
+    }
+    messagesQueued.sub(1);
+    if (event == MESSAGE_EXPIRED) {
+        messagesExpired.add();
+        return;
+    }
+    queueResidence.record(nowUs - msg.timestamp);
+    groupLatencyLocked(msg.toGroup)->residence.record(nowUs - msg.timestamp);
+}
+
+// Caller holds serverMutex
+OutboxBatch takeOutboxLocked() {
+    OutboxBatch batch;
+    batch.out.swap(outbox);
+    batch.latency.reserve(batch.out.size());
+    for (const Outgoing &o : batch.out) {
+        bool message = o.kind == OUT_FORWARD || o.kind == OUT_HANDOFF;
+        batch.latency.push_back(message ? groupLatencyLocked(o.message.toGroup) : nullptr);
+    }
+    return batch;
+}
+
+// A message that reached us at sinceUs has been handed on; g is its group's
+// groupLatencyLocked(), looked up while the caller held serverMutex
+void recordDelivery(const std::shared_ptr<GroupLatency> &g, uint64_t sinceUs) {
+    uint64_t us = monotonicMicros() - sinceUs;
+    deliveryTime.record(us);
+    g->delivery.record(us);
+}
+
 std::string getLocalIPAddress() {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) return "127.0.0.1";
@@ -95,468 +257,766 @@ int open_socket(int portno) {
     return bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ? -1 : sock;
 }
 
-void triggerScan();
+bool isInstructorAddress(const std::string &ip, int port) {
+    if (ip != TSAM_SERVER_IP) return false;
+    return std::find(INSTRUCTOR_PORTS.begin(), INSTRUCTOR_PORTS.end(), port) != INSTRUCTOR_PORTS.end();
+}
+
+// Caller holds serverMutex. Creates the entry; read-only lookups use neighborMetricsLocked.
+// The caller may change it, so the address's candidate score is redone on the next pass.
+NeighborStats &neighborStatsLocked(const std::string &ip, int port) {
+    std::string key = ip + ":" + std::to_string(port);
+    rescoreKeys.insert(key);
+    auto it = neighborStats.find(key);
+    if (it == neighborStats.end())
+        it = neighborStats.insert({key, {{ip, port, -1, -1, -1, -1}, 0, 0, 0, 0, 0}}).first;
+    return it->second;
+}
+
+// EWMA that takes the first sample as is
+double smoothed(double old, double sample) {
+    return old < 0 ? sample : 0.75 * old + 0.25 * sample;
+}
+
+// Caller holds serverMutex. With the live connection to ip:port, blends in its receive
+// rate and the sends it has counted so far.
+NeighborMetrics neighborMetricsLocked(const std::string &ip, int port, const ServerInfo *live = nullptr) {
+    auto it = neighborStats.find(ip + ":" + std::to_string(port));
+    if (it == neighborStats.end()) return {ip, port, -1, -1, -1, -1};
+    const NeighborStats &ns = it->second;
+    NeighborMetrics m = ns.metrics;
+    uint64_t ok = ns.sendsOk, failed = ns.sendsFailed;
+    if (live) {
+        PeerStats ps = peerStats(live->socket);
+        ok += ps.sendsOk;
+        failed += ps.sendsFailed;
+    }
+    if (ok + failed > 0) m.deliveryRate = (double)ok / (ok + failed);
+    time_t up = live && live->connectedSince > 0 ? time(nullptr) - live->connectedSince : 0;
+    if (up > 0 && ns.bytesIn > 0)
+        m.throughputBps = smoothed(m.throughputBps, (double)ns.bytesIn / up);
+    return m;
+}
+
+// Caller holds serverMutex. Folds a closing connection's receive rate and send counts
+// into its address's stats.
+void closeNeighborStatsLocked(const ServerInfo &peer) {
+    if (peer.port <= 0) return;
+    NeighborStats &ns = neighborStatsLocked(peer.ip, peer.port);
+    ns.metrics = neighborMetricsLocked(peer.ip, peer.port, &peer);
+    ns.metrics.deliveryRate = -1;  // Derived from the counters, not stored
+    ns.bytesIn = 0;
+    PeerStats ps = peerStats(peer.socket);
+    ns.sendsOk += ps.sendsOk;
+    ns.sendsFailed += ps.sendsFailed;
+}
+
+// Sends to a peer and counts the outcome towards its delivery rate
+bool sendToPeer(int sock, const std::string &cmd) {
+    uint64_t started = monotonicMicros();
+    std::string frame;
+    {
+        TraceSpan encodeSpan("encode");
+        frame = encodeFrame(cmd);
+    }
+    bool ok = sendFrame(sock, frame);
+    sendTime.record(monotonicMicros() - started);
+    countPeerSend(sock, ok);  // Folded into neighborStats when the connection closes
+    return ok;
+}
 
-void connectToServer(const std::string &ip, int port) {
-    pthread_mutex_lock(&serverMutex);
+// Caller holds serverMutex. Ourselves first, then every peer whose listening port we know.
+std::string buildOurSERVERSLocked(int excludeSock) {
+    std::vector<std::tuple<std::string, std::string, int>> servers;
+    servers.push_back(std::make_tuple(MY_GROUP_ID, myIpAddress, listenPort));
     for (const auto &p : connectedServers)
-        if (p.second.ip == ip && p.second.port == port) { pthread_mutex_unlock(&serverMutex); return; }
-    if (connectedServers.size() >= 8) { pthread_mutex_unlock(&serverMutex); return; }
-    pthread_mutex_unlock(&serverMutex);
+        if (p.first != excludeSock && !p.second.groupId.empty() && p.second.port > 0)
+            servers.push_back(std::make_tuple(p.second.groupId, p.second.ip, p.second.port));
+    return buildSERVERS(servers);
+}
+
+// Caller holds serverMutex. Rebuilds the cached SERVERS only after a membership change.
+const CachedFrame &serversCacheLocked() {
+    if (serversCache.version != membershipVersion) {
+        std::string cmd = buildOurSERVERSLocked(-1);
+        serversCache = {membershipVersion, cmd, std::make_shared<const std::string>(encodeFrame(cmd))};
+    }
+    return serversCache;
+}
+
+// Caller holds serverMutex. SERVERS for one peer: the shared frame unless that peer is
+// itself listed (only outbound peers are) and has to be left out.
+std::shared_ptr<const std::string> serversFrameLocked(int excludeSock) {
+    auto it = connectedServers.find(excludeSock);
+    if (it != connectedServers.end() && !it->second.groupId.empty() && it->second.port > 0)
+        return std::make_shared<const std::string>(encodeFrame(buildOurSERVERSLocked(excludeSock)));
+    return serversCacheLocked().frame;
+}
+
+// Sends what the router decided, outside serverMutex. A message that could not be handed
+// on goes back to the router; a failed direct forward is flooded as if no peer had matched.
+// Returns the number of messages handed on.
+int flushOutbox(OutboxBatch batch) {
+    int handedOn = 0;
+    while (!batch.out.empty()) {
+        std::vector<const Outgoing *> failed;
+        for (size_t i = 0; i < batch.out.size(); i++) {
+            const Outgoing &o = batch.out[i];
+            bool ok = o.frame ? sendFrame(o.link, *o.frame) : sendToPeer(o.link, o.command);
+            if (o.kind == OUT_CONTROL || o.kind == OUT_FLOOD) continue;
+            const Message &m = o.message;
+            if (ok) {
+                recordDelivery(batch.latency[i], m.timestamp);
+                handedOn++;
+                if (o.kind == OUT_HANDOFF) continue;
+                if (m.fromGroup == MY_GROUP_ID) {
+                    messagesSent.add();
+                } else {
+                    messagesForwarded.add();
+                    logMessage("Forwarded " + m.fromGroup + "->" + m.toGroup + " [" +
+                               std::to_string(messagesForwarded.value()) + "]");
+                }
+                continue;
+            }
+            failed.push_back(&o);
+        }
+        if (failed.empty()) break;
+        // Failed handoffs go back to the front of their queues, so put them back last one first
+        PROFILED_LOCK(serverMutex);
+        for (const Outgoing *o : failed)
+            if (o->kind == OUT_FORWARD) router.requeue(o->message, true);
+        for (auto it = failed.rbegin(); it != failed.rend(); ++it)
+            if ((*it)->kind == OUT_HANDOFF) router.requeue((*it)->message, false);
+        OutboxBatch retry = takeOutboxLocked();
+        PROFILED_UNLOCK(serverMutex);
+        std::swap(batch, retry);
+    }
+    return handedOn;
+}
+
+// Turns a completed outbound handshake into a peer. Takes ownership of r.sock.
+// Runs inside the handshake loop, so it never blocks on the peer; the caller
+// runs onPeerRegistered() once the whole batch is done.
+bool registerOutboundPeer(HandshakeResult &r) {
+    const std::string &ip = r.target.ip;
+    int port = r.target.port;
+    int sock = r.sock;
+    std::string responderId = r.responderId;
+    logMessage("Got response: " + r.serversReply.substr(0, 50));
     
-    logMessage("Connecting to " + ip + ":" + std::to_string(port));
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return;
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) <= 0 || 
-        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) { 
-        logMessage("Failed to connect to " + ip + ":" + std::to_string(port));
-        close(sock); 
-        return; 
+    std::vector<std::string> tokens = parseCommand(r.serversReply);
+    if (tokens.size() <= 1) { close(sock); return false; }
+    
+    PROFILED_LOCK(serverMutex);
+    std::string serverList;
+    for (size_t i = 1; i < tokens.size(); i++) {
+        serverList += tokens[i];
+        if (i < tokens.size() - 1) serverList += ",";
+    }
+    std::vector<std::string> entries = splitServers(serverList);
+    if (responderId.empty() && !entries.empty()) {
+        std::vector<std::string> parts = parseCommand(entries[0]);
+        if (parts.size() >= 3) responderId = parts[0];
     }
     
-    if (!sendCommand(sock, buildHELO(MY_GROUP_ID))) { close(sock); return; }
+    // DON'T CONNECT TO SERVERS WITH OUR OWN GROUP ID!
+    if (responderId == MY_GROUP_ID) {
+        PROFILED_UNLOCK(serverMutex);
+        logMessage("Rejecting " + ip + ":" + std::to_string(port) + " - they claim to be " + responderId + " (our ID!)");
+        close(sock);
+        return false;
+    }
     
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
-    struct timeval tv = {10, 0};
-    if (select(sock + 1, &fds, NULL, NULL, &tv) <= 0) { close(sock); return; }
+    for (const auto &entry : entries) {
+        std::vector<std::string> parts = parseCommand(entry);
+        if (parts.size() >= 3) {
+            int p = atoi(parts[2].c_str());
+            if (parts[0] != MY_GROUP_ID && p > 0 && directory.upsert(parts[0], parts[1], p, time(nullptr)))
+                pthread_cond_signal(&connCond);
+        }
+    }
     
-    std::string response;
-    if (!receiveCommand(sock, response)) { 
-        logMessage("No response from " + ip + ":" + std::to_string(port));
-        close(sock); 
-        return; 
+    // Several handshakes can finish together, so the degree is enforced here
+    if (connectedGroupIds.find(responderId) != connectedGroupIds.end() ||
+        (int)connectedServers.size() >= connManager.targets.maxPeers) {
+        PROFILED_UNLOCK(serverMutex);
+        close(sock);
+        return false;
     }
-    logMessage("Got response: " + response.substr(0, 50));
-    std::vector<std::string> tokens = parseCommand(response);
-    if (tokens.empty()) { close(sock); return; }
     
-    std::string responderId = "";
+    bool isInstr = isInstructorAddress(ip, port);
     
-    if (tokens[0] == "HELO" && tokens.size() >= 2) {
-        responderId = tokens[1];
-        pthread_mutex_lock(&serverMutex);
-        if (connectedGroupIds.find(responderId) != connectedGroupIds.end()) {
-            pthread_mutex_unlock(&serverMutex);
-            close(sock);
-            return;
-        }
-        pthread_mutex_unlock(&serverMutex);
-        
-        std::vector<std::tuple<std::string, std::string, int>> servers;
-        servers.push_back(std::make_tuple(MY_GROUP_ID, myIpAddress, listenPort));
-        pthread_mutex_lock(&serverMutex);
+    connectedServers[sock] = {sock, responderId, ip, port, time(nullptr), time(nullptr), true, isInstr, nextConnId++,
+                              r.handshakeMs};
+    connectedGroupIds.insert(responderId);
+    router.addPeer(sock, responderId);
+    membershipVersion++;
+    NeighborStats &ns = neighborStatsLocked(ip, port);
+    ns.metrics.connectRttMs = smoothed(ns.metrics.connectRttMs, r.connectMs);
+    ns.metrics.heloLatencyMs = smoothed(ns.metrics.heloLatencyMs, r.handshakeMs - r.connectMs);
+    ns.bytesIn = 0;
+    // The handshake bypasses sendFrame, so count its two frames here
+    resetPeerStats(sock);
+    std::string helo = buildHELO(MY_GROUP_ID);
+    countPeerFrame(sock, helo.data(), helo.size(), true, 0);
+    countPeerFrame(sock, r.serversReply.data(), r.serversReply.size(), false, 0);
+    int total = connectedServers.size();
+    PROFILED_UNLOCK(serverMutex);
+    r.responderId = responderId;
+    enableFailureDetection(sock, detectSeconds);
+    
+    logMessage("Connected to " + responderId + " in " + std::to_string(r.handshakeMs) + "ms [" +
+               std::to_string(total) + " total]");
+    
+    int* ptr = new int(sock);
+    pthread_t tid;
+    if (pthread_create(&tid, nullptr, peerCommunicationThread, ptr) == 0) {
+        pthread_detach(tid);
+        return true;
+    }
+    delete ptr;
+    PROFILED_LOCK(serverMutex);
+    connectedServers.erase(sock);
+    connectedGroupIds.erase(responderId);
+    router.removePeer(sock);
+    membershipVersion++;
+    PROFILED_UNLOCK(serverMutex);
+    close(sock);
+    return false;
+}
+
+// Dials servers concurrently. Returns "ip:port" -> true for each target that is now (or already was) a peer.
+std::map<std::string, bool> connectToServers(const std::vector<HandshakeTarget> &targets) {
+    std::map<std::string, bool> outcome;
+    std::vector<HandshakeTarget> dial;
+    PROFILED_LOCK(serverMutex);
+    for (const auto &t : targets) {
+        std::string key = t.ip + ":" + std::to_string(t.port);
+        bool connected = false;
         for (const auto &p : connectedServers)
-            if (!p.second.groupId.empty() && p.second.port > 0)  // Only share if we know their port
-                servers.push_back(std::make_tuple(p.second.groupId, p.second.ip, p.second.port));
-        pthread_mutex_unlock(&serverMutex);
-        
-        if (!sendCommand(sock, buildSERVERS(servers))) { close(sock); return; }
-        
-        FD_ZERO(&fds);
-        FD_SET(sock, &fds);
-        tv.tv_sec = 10;
-        if (select(sock + 1, &fds, NULL, NULL, &tv) <= 0 || !receiveCommand(sock, response)) {
-            close(sock);
-            return;
-        }
-        tokens = parseCommand(response);
-        if (tokens.empty() || tokens[0] != "SERVERS") { close(sock); return; }
+            if (p.second.ip == t.ip && p.second.port == t.port) { connected = true; break; }
+        outcome[key] = connected;
+        if (!connected) dial.push_back(t);
     }
+    PROFILED_UNLOCK(serverMutex);
+    if (dial.empty()) return outcome;
     
-    if (tokens[0] == "SERVERS" && tokens.size() > 1) {
-        pthread_mutex_lock(&serverMutex);
-        std::string serverList;
-        for (size_t i = 1; i < tokens.size(); i++) {
-            serverList += tokens[i];
-            if (i < tokens.size() - 1) serverList += ",";
-        }
-        std::vector<std::string> entries = splitServers(serverList);
-        if (responderId.empty() && !entries.empty()) {
-            std::vector<std::string> parts = parseCommand(entries[0]);
-            if (parts.size() >= 3) responderId = parts[0];
-        }
-        
-        // DON'T CONNECT TO SERVERS WITH OUR OWN GROUP ID!
-        if (responderId == MY_GROUP_ID) {
-            pthread_mutex_unlock(&serverMutex);
-            logMessage("Rejecting " + ip + ":" + std::to_string(port) + " - they claim to be " + responderId + " (our ID!)");
-            close(sock);
-            return;
+    for (const auto &t : dial) logMessage("Connecting to " + t.ip + ":" + std::to_string(t.port));
+    HandshakeHooks hooks;
+    hooks.helo = buildHELO(MY_GROUP_ID);
+    hooks.buildServers = [] {
+        PROFILED_LOCK(serverMutex);
+        std::string cmd = serversCacheLocked().command;
+        PROFILED_UNLOCK(serverMutex);
+        return cmd;
+    };
+    hooks.accept = [](const std::string &responderId) {
+        PROFILED_LOCK(serverMutex);
+        bool fresh = connectedGroupIds.find(responderId) == connectedGroupIds.end();
+        PROFILED_UNLOCK(serverMutex);
+        return fresh;
+    };
+    std::vector<std::pair<int, std::string>> registered;
+    hooks.onDone = [&outcome, &registered](HandshakeResult &r) {
+        std::string key = r.target.ip + ":" + std::to_string(r.target.port);
+        PROFILED_LOCK(serverMutex);
+        NeighborStats &ns = neighborStatsLocked(r.target.ip, r.target.port);
+        r.sock < 0 ? ns.dialsFailed++ : ns.dialsOk++;
+        PROFILED_UNLOCK(serverMutex);
+        if (r.sock < 0) {
+            logMessage("Failed to connect to " + key + ": " + r.error);
+            outcome[key] = false;
+        } else {
+            if (!synRetransmitted(r.sock)) recordConnectRtt(r.target.ip, r.connectMs);
+            outcome[key] = registerOutboundPeer(r);
+            if (outcome[key]) registered.push_back({r.sock, r.responderId});
         }
+    };
+    runHandshakes(dial, hooks, HANDSHAKE_TIMEOUT_MS);
+    // STATUSREQ and backlog pushes block on the peer, so they wait until no handshake is in flight
+    for (const auto &p : registered) onPeerRegistered(p.first, p.second);
+    return outcome;
+}
+
+// Caller holds serverMutex. Brings candidateCache up to date: entries the directory changed
+// are rebuilt, and entries whose neighbor stats changed are rescored; the rest are left as
+// they were. Returns the number of directory entries that changed.
+size_t refreshCandidatesLocked() {
+    std::vector<DirectoryEntry> changed = directory.changedSince(candidateVersion);
+    candidateVersion = directory.version();
+    for (const DirectoryEntry &e : changed) {
+        std::string key = e.ip + ":" + std::to_string(e.port);
+        double score = neighborScorer(neighborMetricsLocked(e.ip, e.port), listenPort);
+        candidateCache[key] = {e.groupId, e.ip, e.port, isInstructorAddress(e.ip, e.port), e.lastHeard, score};
+        rescoreKeys.erase(key);
+    }
+    for (const std::string &key : rescoreKeys) {
+        auto it = candidateCache.find(key);
+        if (it != candidateCache.end())
+            it->second.score = neighborScorer(neighborMetricsLocked(it->second.ip, it->second.port), listenPort);
+    }
+    rescoreKeys.clear();
+    return changed.size();
+}
+
+// Caller holds serverMutex. Known servers we are not connected to, plus the instructor ports.
+std::vector<DialCandidate> dialCandidatesLocked() {
+    refreshCandidatesLocked();
+    std::vector<DialCandidate> cands;
+    std::set<std::string> seen;
+    for (const auto &p : connectedServers) seen.insert(p.second.ip + ":" + std::to_string(p.second.port));
+    for (const auto &p : candidateCache) {
+        const DialCandidate &c = p.second;
+        if (connectedGroupIds.count(c.groupId) || !seen.insert(p.first).second) continue;
+        cands.push_back(c);
+    }
+    for (int p : offline ? std::vector<int>() : INSTRUCTOR_PORTS)
+        if (seen.insert(TSAM_SERVER_IP + ":" + std::to_string(p)).second)
+            cands.push_back({"", TSAM_SERVER_IP, p, true, 0, neighborScorer(neighborMetricsLocked(TSAM_SERVER_IP, p), listenPort)});
+    return cands;
+}
+
+// Discovery results have no group id yet; the handshake fills it in
+void onPortFound(const std::string &ip, int port) {
+    PROFILED_LOCK(serverMutex);
+    bool added = directory.upsert("", ip, port, time(nullptr));
+    if (added) pthread_cond_signal(&connCond);
+    PROFILED_UNLOCK(serverMutex);
+    if (added) logMessage("Discovered server at " + ip + ":" + std::to_string(port));
+}
+
+// Owns the peer degree: wakes on disconnects and new known servers, dials the best
+// candidates right away and retries failures with per-candidate backoff.
+// Port discovery runs on its own thread and feeds the directory.
+void *connectionManagerThread(void *arg) {
+    (void)arg;
+    while (true) {
+        PROFILED_LOCK(serverMutex);
+        size_t changed = refreshCandidatesLocked();
+        if (changed > 0)
+            logMessage("Directory: " + std::to_string(changed) + " new or changed servers, " +
+                       std::to_string(directory.size()) + " known");
+        int students = 0, instructors = 0;
+        for (const auto &p : connectedServers)
+            p.second.isInstructor ? instructors++ : students++;
+        uint64_t now = monotonicMillis();
+        std::vector<DialCandidate> cands = dialCandidatesLocked();
+        std::vector<DialCandidate> picks = connManager.pickCandidates(cands, students, instructors, now);
+        if (picks.empty() && students + instructors < connManager.targets.minPeers)
+            discovery.requestSweep();
         
-        for (const auto &entry : entries) {
-            std::vector<std::string> parts = parseCommand(entry);
-            if (parts.size() >= 3) {
-                KnownServer ks = {parts[0], parts[1], std::stoi(parts[2]), time(nullptr)};
-                if (ks.groupId != MY_GROUP_ID && connectedGroupIds.find(ks.groupId) == connectedGroupIds.end()) {
-                    bool found = false;
-                    for (auto &e : knownServers) {
-                        if (e.groupId == ks.groupId) { e = ks; found = true; break; }
-                    }
-                    if (!found) knownServers.push_back(ks);
-                }
-            }
+        if (picks.empty()) {
+            // Sleep until a candidate leaves backoff, something changes, or the idle recheck
+            uint64_t wakeMs = now + MANAGER_IDLE_WAIT * 1000ULL;
+            uint64_t retryMs = connManager.nextRetryMs(cands, now);
+            if (retryMs != 0 && retryMs < wakeMs) wakeMs = retryMs;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t deadlineNs = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + (wakeMs - now) * 1000000ULL;
+            ts.tv_sec = deadlineNs / 1000000000ULL;
+            ts.tv_nsec = deadlineNs % 1000000000ULL;
+            serverMutex.timedWait(&connCond, &ts);
+            PROFILED_UNLOCK(serverMutex);
+            continue;
         }
+        PROFILED_UNLOCK(serverMutex);
         
-        if (connectedGroupIds.find(responderId) != connectedGroupIds.end()) {
-            pthread_mutex_unlock(&serverMutex);
-            close(sock);
-            return;
+        std::vector<HandshakeTarget> targets;
+        for (const auto &c : picks) targets.push_back({c.ip, c.port});
+        std::map<std::string, bool> outcome = connectToServers(targets);
+        PROFILED_LOCK(serverMutex);
+        for (const auto &c : picks) {
+            if (outcome[c.ip + ":" + std::to_string(c.port)]) connManager.recordSuccess(c, monotonicMillis());
+            else connManager.recordFailure(c, monotonicMillis());
         }
-        
-        bool isInstr = false;
-        for (int p : INSTRUCTOR_PORTS) if (port == p && ip == TSAM_SERVER_IP) { isInstr = true; break; }
-        
-        connectedServers[sock] = {sock, responderId, ip, port, time(nullptr), time(nullptr), true, isInstr};
-        connectedGroupIds.insert(responderId);
-        pthread_mutex_unlock(&serverMutex);
-        
-        logMessage("Connected to " + responderId + " [" + std::to_string(connectedServers.size()) + " total]");
-        
-        int* ptr = new int(sock);
-        pthread_t tid;
-        if (pthread_create(&tid, nullptr, peerCommunicationThread, ptr) == 0) {
-            pthread_detach(tid);
-        } else {
-            delete ptr;
-            pthread_mutex_lock(&serverMutex);
-            connectedServers.erase(sock);
-            connectedGroupIds.erase(responderId);
-            pthread_mutex_unlock(&serverMutex);
-            close(sock);
-        }
-    } else close(sock);
+        PROFILED_UNLOCK(serverMutex);
+    }
+    return NULL;
+}
+
+// Caller holds serverMutex. Returns the peer only if sock still belongs to connection connId.
+ServerInfo *findPeer(int sock, unsigned long connId) {
+    auto it = connectedServers.find(sock);
+    return (it != connectedServers.end() && it->second.connId == connId) ? &it->second : nullptr;
+}
+
+// Caller holds serverMutex. The peer thread sees the shutdown and closes the socket.
+// A failed peer counts against its delivery rate; a replaced one does not.
+void dropPeerLocked(int sock, const std::string &reason, bool failed = true) {
+    auto it = connectedServers.find(sock);
+    if (it == connectedServers.end()) return;
+    std::string gid = it->second.groupId;
+    logMessage("Removing " + gid + ": " + reason);
+    closeNeighborStatsLocked(it->second);
+    connManager.recordDisconnect(it->second.ip, it->second.port, monotonicMillis());
+    if (failed && it->second.port > 0) neighborStatsLocked(it->second.ip, it->second.port).sendsFailed++;
+    connectedGroupIds.erase(gid);
+    forgetGroupLatencyLocked(gid);
+    lastHeloAttempt.erase(gid);
+    router.removePeer(sock);
+    peerProbes.erase(sock);
+    connectedServers.erase(it);
+    membershipVersion++;
+    shutdown(sock, SHUT_RDWR);
+    pthread_cond_signal(&connCond);
+}
+
+// Spread periodic per-peer work by +-10% so peers are not all hit in the same tick
+uint64_t jitteredMs(int seconds) {
+    static thread_local std::mt19937 rng(std::random_device{}());
+    std::uniform_int_distribution<int> pct(-10, 10);
+    return static_cast<uint64_t>(seconds) * (1000 + 10 * pct(rng));
 }
 
-void tryKnownServers() {
-    pthread_mutex_lock(&serverMutex);
-    std::vector<KnownServer> cands = knownServers;
-    pthread_mutex_unlock(&serverMutex);
+void keepaliveTimer(int sock, unsigned long connId) {
+    PROFILED_LOCK(serverMutex);
+    ServerInfo *peer = findPeer(sock, connId);
+    int count = peer ? router.queuedFor(peer->groupId) : 0;
+    PROFILED_UNLOCK(serverMutex);
+    if (!peer) return;
     
-    for (const auto &s : cands) {
-        pthread_mutex_lock(&serverMutex);
-        bool connected = connectedGroupIds.find(s.groupId) != connectedGroupIds.end();
-        bool full = connectedServers.size() >= 8;
-        pthread_mutex_unlock(&serverMutex);
-        if (full) break;
-        if (!connected) { connectToServer(s.ip, s.port); sleep(2); }
+    if (!sendCommand(sock, buildKEEPALIVE(count))) {
+        PROFILED_LOCK(serverMutex);
+        dropPeerLocked(sock, "KEEPALIVE send failed");
+        PROFILED_UNLOCK(serverMutex);
+        return;
     }
+    timers.schedule(jitteredMs(KEEPALIVE_INTERVAL), [=] { keepaliveTimer(sock, connId); });
 }
 
-void triggerScan() {
-    pthread_mutex_lock(&serverMutex);
-    if (isScanning) { pthread_mutex_unlock(&serverMutex); return; }
-    isScanning = true;
-    pthread_mutex_unlock(&serverMutex);
-    
-    tryKnownServers();
-    
-    pthread_mutex_lock(&serverMutex);
-    int conn = connectedServers.size();
-    pthread_mutex_unlock(&serverMutex);
+void statusReqTimer(int sock, unsigned long connId) {
+    PROFILED_LOCK(serverMutex);
+    bool current = findPeer(sock, connId) != nullptr;
+    PROFILED_UNLOCK(serverMutex);
+    if (!current) return;
     
-    if (conn >= 3) {
-        pthread_mutex_lock(&serverMutex);
-        isScanning = false;
-        pthread_mutex_unlock(&serverMutex);
+    if (!sendCommand(sock, buildSTATUSREQ())) {
+        PROFILED_LOCK(serverMutex);
+        dropPeerLocked(sock, "STATUSREQ send failed");
+        PROFILED_UNLOCK(serverMutex);
         return;
     }
-    
-    std::vector<int> ports = scanForServers(TSAM_SERVER_IP, 4000, 4200, listenPort);
-    for (int p : ports) {
-        pthread_mutex_lock(&serverMutex);
-        if (connectedServers.size() >= 8) { pthread_mutex_unlock(&serverMutex); break; }
-        pthread_mutex_unlock(&serverMutex);
-        connectToServer(TSAM_SERVER_IP, p);
-        sleep(2);
+    timers.schedule(jitteredMs(STATUSREQ_INTERVAL), [=] { statusReqTimer(sock, connId); });
+}
+
+// Fires at lastSeen + PEER_IDLE_TIMEOUT; traffic since then just pushes the deadline out
+void idleTimer(int sock, unsigned long connId) {
+    PROFILED_LOCK(serverMutex);
+    ServerInfo *peer = findPeer(sock, connId);
+    if (!peer) { PROFILED_UNLOCK(serverMutex); return; }
+    time_t idle = time(nullptr) - peer->lastSeen;
+    if (idle >= PEER_IDLE_TIMEOUT) {
+        dropPeerLocked(sock, "idle for " + std::to_string(idle) + "s");
+        PROFILED_UNLOCK(serverMutex);
+        return;
+    }
+    PROFILED_UNLOCK(serverMutex);
+    timers.schedule((PEER_IDLE_TIMEOUT - idle) * 1000, [=] { idleTimer(sock, connId); });
+}
+
+// Ping with STATUSREQ every detectSeconds/3; a ping unanswered for detectSeconds declares the peer dead
+void probeTimer(int sock, unsigned long connId) {
+    uint64_t now = monotonicMillis();
+    PROFILED_LOCK(serverMutex);
+    if (!findPeer(sock, connId)) { PROFILED_UNLOCK(serverMutex); return; }
+    ProbeState &probe = peerProbes[sock];
+    if (probeTimedOut(probe, now, detectSeconds)) {
+        dropPeerLocked(sock, "no probe reply in " + std::to_string(detectSeconds) + "s");
+        PROFILED_UNLOCK(serverMutex);
+        return;
     }
+    bool ping = !probe.outstanding;
+    if (ping) { probe.outstanding = true; probe.sentAtMs = now; }
+    PROFILED_UNLOCK(serverMutex);
     
-    pthread_mutex_lock(&serverMutex);
-    conn = connectedServers.size();
-    pthread_mutex_unlock(&serverMutex);
+    if (ping && !sendCommand(sock, buildSTATUSREQ())) {
+        PROFILED_LOCK(serverMutex);
+        dropPeerLocked(sock, "probe send failed");
+        PROFILED_UNLOCK(serverMutex);
+        return;
+    }
+    timers.schedule(std::max(1, detectSeconds / 3) * 1000, [=] { probeTimer(sock, connId); });
+}
+
+// Caller holds serverMutex
+void schedulePeerTimers(int sock, unsigned long connId) {
+    timers.schedule(jitteredMs(KEEPALIVE_INTERVAL), [=] { keepaliveTimer(sock, connId); });
+    timers.schedule(PEER_IDLE_TIMEOUT * 1000, [=] { idleTimer(sock, connId); });
+    if (probeEnabled) {
+        // The probe's STATUSREQs replace the periodic ones
+        peerProbes[sock] = {0, false, -1};
+        timers.schedule(std::max(1, detectSeconds / 3) * 1000, [=] { probeTimer(sock, connId); });
+    } else {
+        timers.schedule(jitteredMs(STATUSREQ_INTERVAL), [=] { statusReqTimer(sock, connId); });
+    }
+}
+
+void statusTimer() {
+    PROFILED_LOCK(serverMutex);
+    int conn = connectedServers.size(), stuConn = 0, insConn = 0;
+    for (const auto &p : connectedServers)
+        p.second.isInstructor ? insConn++ : stuConn++;
+    std::string residence;
+    for (const auto &g : groupLatency) {
+        const Histogram &h = g.second->residence;
+        if (h.count() == 0) continue;
+        residence += " " + g.first + ":" + std::to_string(h.percentile(0.5) / 1000) + "/" +
+                     std::to_string(h.percentile(0.99) / 1000) + "/" + std::to_string(h.max() / 1000);
+    }
+    PROFILED_UNLOCK(serverMutex);
     
-    if (conn < 3) {
-        for (int p : INSTRUCTOR_PORTS) {
-            if (isPortOpen(TSAM_SERVER_IP, p, 500)) {
-                connectToServer(TSAM_SERVER_IP, p);
-                pthread_mutex_lock(&serverMutex);
-                if (connectedServers.size() >= 3) { pthread_mutex_unlock(&serverMutex); break; }
-                pthread_mutex_unlock(&serverMutex);
-                sleep(2);
+    logMessage("Status: " + std::to_string(conn) + " connections (" + std::to_string(stuConn) + 
+               " students, " + std::to_string(insConn) + " instructors) | RX:" + std::to_string(messagesReceived.value()) +
+               " TX:" + std::to_string(messagesSent.value()) + " FWD:" + std::to_string(messagesForwarded.value()) +
+               " EXP:" + std::to_string(messagesExpired.value()) + " TIMERS:" + std::to_string(timers.pending()));
+    if (!residence.empty()) logMessage("Queue residence p50/p99/max ms:" + residence);
+    timers.schedule(STATUS_LOG_INTERVAL * 1000, statusTimer);
+}
+
+// Refreshes the kernel's view (rtt, cwnd, retransmits, send queue) of every peer socket
+void peerTcpTimer() {
+    PROFILED_LOCK(serverMutex);
+    for (const auto &p : connectedServers) samplePeerTcp(p.first);
+    PROFILED_UNLOCK(serverMutex);
+    timers.schedule(PEER_TCP_SAMPLE_INTERVAL * 1000, peerTcpTimer);
+}
+
+// Re-scores the student peers against the known candidates when the budget is full and
+// swaps the worst peer for a clearly better candidate, one per round so the mesh settles
+void neighborTimer() {
+    PROFILED_LOCK(serverMutex);
+    if ((int)connectedServers.size() >= connManager.targets.maxPeers) {
+        std::vector<NeighborMetrics> pool;
+        std::map<std::string, int> peerSock;
+        for (const auto &p : connectedServers) {
+            const ServerInfo &s = p.second;
+            if (s.isInstructor || s.port <= 0) continue;  // Instructors have their own quota; inbound peers cannot be redialed
+            pool.push_back(neighborMetricsLocked(s.ip, s.port, &s));
+            peerSock[s.ip + ":" + std::to_string(s.port)] = p.first;
+        }
+        int slots = pool.size();
+        for (const auto &c : dialCandidatesLocked())
+            if (!c.isInstructor) pool.push_back(neighborMetricsLocked(c.ip, c.port));
+        
+        std::vector<NeighborMetrics> chosen = selectNeighbors(pool, listenPort, slots, neighborScorer);
+        std::set<std::string> keep;
+        const NeighborMetrics *best = nullptr;
+        for (const auto &m : chosen) {
+            std::string key = m.ip + ":" + std::to_string(m.port);
+            keep.insert(key);
+            if (!best && !peerSock.count(key)) best = &m;
+        }
+        const NeighborMetrics *worst = nullptr;
+        double worstScore = 0;
+        for (const auto &m : pool) {
+            std::string key = m.ip + ":" + std::to_string(m.port);
+            if (!peerSock.count(key) || keep.count(key)) continue;
+            double sc = neighborScorer(m, listenPort);
+            if (!worst || sc < worstScore) { worst = &m; worstScore = sc; }
+        }
+        if (best && worst) {
+            double bestScore = neighborScorer(*best, listenPort);
+            if (bestScore - worstScore >= NEIGHBOR_SWAP_MARGIN) {
+                char buf[64];
+                snprintf(buf, sizeof(buf), " (score %.1f vs %.1f)", bestScore, worstScore);
+                dropPeerLocked(peerSock[worst->ip + ":" + std::to_string(worst->port)],
+                               "replaced by " + best->ip + ":" + std::to_string(best->port) + buf, false);
             }
         }
     }
+    PROFILED_UNLOCK(serverMutex);
+    timers.schedule(NEIGHBOR_REEVAL_INTERVAL * 1000, neighborTimer);
+}
+
+// Caller holds serverMutex. Known servers plus outbound peers, one entry per ip:port.
+std::vector<SnapshotEntry> buildSnapshotLocked() {
+    std::map<std::string, SnapshotEntry> byAddr;
+    auto add = [&](const std::string &gid, const std::string &ip, int port, time_t seen) {
+        std::string key = ip + ":" + std::to_string(port);
+        auto it = byAddr.find(key);
+        if (it != byAddr.end()) {
+            if (it->second.groupId.empty()) it->second.groupId = gid;
+            it->second.lastSeen = std::max(it->second.lastSeen, seen);
+            return;
+        }
+        auto ns = neighborStats.find(key);
+        if (ns == neighborStats.end()) byAddr[key] = {gid, ip, port, seen, -1, 0, 0};
+        else byAddr[key] = {gid, ip, port, seen, ns->second.metrics.connectRttMs, ns->second.dialsOk, ns->second.dialsFailed};
+    };
+    for (const auto &p : connectedServers)
+        if (p.second.port > 0 && !p.second.groupId.empty())
+            add(p.second.groupId, p.second.ip, p.second.port, p.second.lastSeen);
+    directory.forEach([&](const DirectoryEntry &e) { add(e.groupId, e.ip, e.port, e.lastHeard); });
     
-    pthread_mutex_lock(&serverMutex);
-    isScanning = false;
-    pthread_mutex_unlock(&serverMutex);
+    std::vector<SnapshotEntry> entries;
+    for (const auto &p : byAddr) entries.push_back(p.second);
+    return entries;
+}
+
+// Returns the number of servers saved, or -1 on failure
+int writeSnapshot() {
+    if (snapshotPath.empty()) return 0;
+    PROFILED_LOCK(serverMutex);
+    std::vector<SnapshotEntry> entries = buildSnapshotLocked();
+    PROFILED_UNLOCK(serverMutex);
+    return saveSnapshot(snapshotPath, entries) ? (int)entries.size() : -1;
 }
 
+void snapshotTimer() {
+    if (writeSnapshot() < 0) logMessage("Could not write " + snapshotPath);
+    timers.schedule(SNAPSHOT_INTERVAL * 1000, snapshotTimer);
+}
+
+// SIGINT/SIGTERM are blocked everywhere and taken here with sigwait,
+// so the final snapshot is written on a normal thread, not in a handler
+void *signalThread(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    int sig = 0;
+    // SIGUSR1 dumps the trace; anything else shuts down
+    while (sigwait(set, &sig) == 0 && sig == SIGUSR1) {
+        int spans = tracing ? writeTrace(tracePath) : -1;
+        logMessage(spans >= 0 ? "Trace: " + std::to_string(spans) + " spans written to " + tracePath :
+                   tracing ? "Trace: could not write " + tracePath : "Trace: tracing is off (--trace)");
+    }
+    int saved = writeSnapshot();
+    logMessage("Caught signal " + std::to_string(sig) + ", saved " + std::to_string(saved) +
+               " known servers, shutting down");
+    for (const auto &line : lockProfileLines()) logMessage(line);
+    exit(0);
+    return NULL;
+}
+
+// Drives the timer wheel; all periodic work is scheduled on it
 void *healthMonitorThread(void *arg) {
     (void)arg;
-    time_t lastKA = time(nullptr), lastGM = time(nullptr), lastSR = time(nullptr), lastCC = time(nullptr);
+    timers.schedule(STATUS_LOG_INTERVAL * 1000, statusTimer);
+    timers.schedule(NEIGHBOR_REEVAL_INTERVAL * 1000, neighborTimer);
+    timers.schedule(SNAPSHOT_INTERVAL * 1000, snapshotTimer);
+    timers.schedule(PEER_TCP_SAMPLE_INTERVAL * 1000, peerTcpTimer);
     
     while (true) {
-        sleep(30);
-        time_t now = time(nullptr);
-        
-        if (now - lastKA >= 60) {
-            pthread_mutex_lock(&serverMutex);
-            int sent = 0;
-            std::vector<int> failed;
-            for (const auto &p : connectedServers) {
-                if (!p.second.groupId.empty()) {
-                    if (sendCommand(p.first, buildKEEPALIVE(messageQueue[p.second.groupId].size()))) {
-                        sent++;
-                    } else {
-                        failed.push_back(p.first);
-                    }
-                }
-            }
-            for (int sock : failed) {
-                logMessage("Removing dead connection: " + connectedServers[sock].groupId);
-                std::string gid = connectedServers[sock].groupId;
-                connectedGroupIds.erase(gid);
-                lastHeloAttempt.erase(gid);
-                close(sock);
-                connectedServers.erase(sock);
-            }
-            pthread_mutex_unlock(&serverMutex);
-            if (sent > 0) logMessage("Sent KEEPALIVE to " + std::to_string(sent) + " peers");
-            lastKA = now;
-        }
-        
-        if (now - lastGM >= 90) {
-            pthread_mutex_lock(&serverMutex);
-            int sent = 0;
-            std::vector<int> failed;
-            for (const auto &p : connectedServers) {
-                if (!p.second.groupId.empty()) {
-                    if (sendCommand(p.first, buildGETMSGS(MY_GROUP_ID))) {
-                        sent++;
-                    } else {
-                        failed.push_back(p.first);
-                    }
-                }
-            }
-            for (int sock : failed) {
-                logMessage("Removing dead connection: " + connectedServers[sock].groupId);
-                std::string gid = connectedServers[sock].groupId;
-                connectedGroupIds.erase(gid);
-                lastHeloAttempt.erase(gid);
-                close(sock);
-                connectedServers.erase(sock);
-            }
-            pthread_mutex_unlock(&serverMutex);
-            if (sent > 0) logMessage("Sent GETMSGS to " + std::to_string(sent) + " peers");
-            lastGM = now;
-        }
-        
-        if (now - lastSR >= 180) {
-            pthread_mutex_lock(&serverMutex);
-            int sent = 0;
-            std::vector<int> failed;
-            for (const auto &p : connectedServers) {
-                if (!p.second.groupId.empty()) {
-                    if (sendCommand(p.first, buildSTATUSREQ())) {
-                        sent++;
-                    } else {
-                        failed.push_back(p.first);
-                    }
-                }
-            }
-            for (int sock : failed) {
-                logMessage("Removing dead connection: " + connectedServers[sock].groupId);
-                std::string gid = connectedServers[sock].groupId;
-                connectedGroupIds.erase(gid);
-                lastHeloAttempt.erase(gid);
-                close(sock);
-                connectedServers.erase(sock);
-            }
-            pthread_mutex_unlock(&serverMutex);
-            if (sent > 0) logMessage("Sent STATUSREQ to " + std::to_string(sent) + " peers");
-            lastSR = now;
-        }
-        
-        pthread_mutex_lock(&serverMutex);
-        std::vector<int> toRemove;
-        for (auto &p : connectedServers)
-            if (now - p.second.lastSeen > 300)
-                toRemove.push_back(p.first);
-        for (int s : toRemove) {
-            std::string gid = connectedServers[s].groupId;
-            connectedGroupIds.erase(gid);
-            lastHeloAttempt.erase(gid);
-            close(s);
-            connectedServers.erase(s);
-        }
-        
-        int conn = connectedServers.size(), stuConn = 0, insConn = 0;
-        for (const auto &p : connectedServers)
-            p.second.isInstructor ? insConn++ : stuConn++;
-        pthread_mutex_unlock(&serverMutex);
-        
-        logMessage("Status: " + std::to_string(conn) + " connections (" + std::to_string(stuConn) + 
-                   " students, " + std::to_string(insConn) + " instructors) | RX:" + std::to_string(messagesReceived) +
-                   " TX:" + std::to_string(messagesSent) + " FWD:" + std::to_string(messagesForwarded));
-        
-        if (now - lastCC >= 120) {
-            if (conn < 3) triggerScan();
-            else if (stuConn < 3 && conn < 8) tryKnownServers();
-            lastCC = now;
-        }
+        usleep(TIMER_TICK_MS * 1000);
+        PROFILED_LOCK(serverMutex);
+        router.expire();
+        PROFILED_UNLOCK(serverMutex);
+        timers.advance(monotonicMillis());
     }
     return NULL;
 }
 
+// Every peer command but HELO goes through the router; here we log what it did and send what it decided
+void routePeerCommand(int sock, const std::vector<std::string> &tokens, const std::string &hops) {
+    TraceSpan routeSpan("route");
+    const std::string &kind = tokens[0];
+    PROFILED_LOCK(serverMutex);
+    RouteResult r = router.handle(sock, tokens, hops);
+    OutboxBatch out = takeOutboxLocked();
+    std::string from = connectedServers.find(sock) != connectedServers.end() ? connectedServers[sock].groupId : "?";
+    if (r.action == ROUTE_DELIVERED) deliveredByHops[r.message.hopCount]++;
+    size_t groups = 0;
+    int forUs = 0, rtt = -1;
+    if (kind == "STATUSRESP") {
+        const std::map<std::string, int> *report = router.report(sock);
+        if (report) {
+            groups = report->size();
+            auto it = report->find(MY_GROUP_ID);
+            if (it != report->end()) forUs = it->second;
+        }
+        auto probe = peerProbes.find(sock);
+        if (probe != peerProbes.end()) rtt = completeProbe(probe->second, monotonicMillis());
+    }
+    PROFILED_UNLOCK(serverMutex);
+    
+    if (r.action == ROUTE_IGNORED) return;
+    if (kind == "KEEPALIVE") logMessage("KEEPALIVE from " + from + " (" + tokens[1] + " msgs)");
+    else if (kind == "GETMSGS") logMessage("GETMSGS request for " + tokens[1]);
+    else if (kind == "STATUSREQ") logMessage("STATUSREQ received");
+    else if (kind == "NO_MESSAGES") logMessage("NO_MESSAGES from peer");
+    else if (kind == "STATUSRESP")
+        logMessage("STATUSRESP from " + from + ": " + std::to_string(groups) + " groups, " + std::to_string(forUs) +
+                   " msgs for us" + (rtt >= 0 ? " (rtt " + std::to_string(rtt) + "ms)" : ""));
+    else if (r.action == ROUTE_LOOPED) {
+        loopsDetected.add();
+        logMessage("Loop detected, dropping msg (loops:" + std::to_string(loopsDetected.value()) + ")");
+    } else if (r.action == ROUTE_DUPLICATE) {
+        duplicatesDropped.add();
+        logMessage("Duplicate of " + r.message.fromGroup + "->" + r.message.toGroup + " dropped (duplicates:" +
+                   std::to_string(duplicatesDropped.value()) + ")");
+    } else if (r.action == ROUTE_DELIVERED) {
+        messagesReceived.add();
+        logMessage("Received msg from " + r.message.fromGroup + " (hops:" + std::to_string(r.message.hopCount) + ")");
+    }
+    flushOutbox(out);
+}
+
 void handleServerCommand(int sock, const std::string &cmd) {
+    TraceSpan handleSpan("handle", frameKindName(cmd.data(), cmd.size()));
+    uint64_t receivedUs = monotonicMicros();
     std::string main, hops;
     parseSENDMSGWithHops(cmd, main, hops);
     std::vector<std::string> tokens = parseCommand(main);
+    if (tracing) traceSpan("decode", nullptr, receivedUs, monotonicMicros() - receivedUs);
     if (tokens.empty()) return;
     
-    pthread_mutex_lock(&serverMutex);
+    PROFILED_LOCK(serverMutex);
     if (connectedServers.find(sock) != connectedServers.end())
         connectedServers[sock].lastSeen = time(nullptr);
-    pthread_mutex_unlock(&serverMutex);
+    PROFILED_UNLOCK(serverMutex);
     
     if (tokens[0] == "HELO" && tokens.size() >= 2) {
         std::string from = tokens[1];
         logMessage("HELO from " + from);
-        pthread_mutex_lock(&serverMutex);
+        PROFILED_LOCK(serverMutex);
         if (connectedGroupIds.find(from) != connectedGroupIds.end()) {
-            pthread_mutex_unlock(&serverMutex);
+            PROFILED_UNLOCK(serverMutex);
             return;
         }
         if (connectedServers.find(sock) != connectedServers.end()) {
             connectedServers[sock].groupId = from;
             connectedGroupIds.insert(from);
+            router.addPeer(sock, from);
+            membershipVersion++;
             logMessage("Accepted HELO from " + from + " [" + std::to_string(connectedGroupIds.size()) + " peers]");
-        } else { pthread_mutex_unlock(&serverMutex); return; }
-        pthread_mutex_unlock(&serverMutex);
+        } else { PROFILED_UNLOCK(serverMutex); return; }
+        PROFILED_UNLOCK(serverMutex);
         
-        std::vector<std::tuple<std::string, std::string, int>> servers;
-        servers.push_back(std::make_tuple(MY_GROUP_ID, myIpAddress, listenPort));
-        pthread_mutex_lock(&serverMutex);
-        for (const auto &p : connectedServers)
-            if (p.first != sock && !p.second.groupId.empty() && p.second.port > 0)  // Only share if we know their port
-                servers.push_back(std::make_tuple(p.second.groupId, p.second.ip, p.second.port));
-        pthread_mutex_unlock(&serverMutex);
-        sendCommand(sock, buildSERVERS(servers));
-    }
-    else if (tokens[0] == "KEEPALIVE" && tokens.size() >= 2) {
-        int cnt = std::stoi(tokens[1]);
-        pthread_mutex_lock(&serverMutex);
-        std::string from = connectedServers.find(sock) != connectedServers.end() ? connectedServers[sock].groupId : "?";
-        pthread_mutex_unlock(&serverMutex);
-        logMessage("KEEPALIVE from " + from + " (" + std::to_string(cnt) + " msgs)");
-        if (cnt > 0) sendCommand(sock, buildGETMSGS(MY_GROUP_ID));
-    }
-    else if (tokens[0] == "GETMSGS" && tokens.size() >= 2) {
-        std::string forGroup = tokens[1];
-        logMessage("GETMSGS request for " + forGroup);
-        pthread_mutex_lock(&serverMutex);
-        bool has = !messageQueue[forGroup].empty();
-        pthread_mutex_unlock(&serverMutex);
-        if (has) {
-            pthread_mutex_lock(&serverMutex);
-            Message msg = messageQueue[forGroup].front();
-            messageQueue[forGroup].pop();
-            pthread_mutex_unlock(&serverMutex);
-            sendCommand(sock, buildSENDMSG(forGroup, msg.fromGroup, msg.content, msg.hops));
-        } else sendCommand(sock, "NO_MESSAGES");
+        PROFILED_LOCK(serverMutex);
+        std::shared_ptr<const std::string> servers = serversFrameLocked(sock);
+        PROFILED_UNLOCK(serverMutex);
+        sendFrame(sock, *servers);
     }
-    else if (tokens[0] == "SENDMSG" && tokens.size() >= 4) {
-        std::string to = tokens[1], from = tokens[2], content;
-        for (size_t i = 3; i < tokens.size(); i++) {
-            content += tokens[i];
-            if (i < tokens.size() - 1) content += ",";
-        }
-        
-        if (isInHops(hops, MY_GROUP_ID)) { 
-            loopsDetected++; 
-            logMessage("Loop detected, dropping msg (loops:" + std::to_string(loopsDetected) + ")");
-            return; 
-        }
-        
-        int hopCnt = 0;
-        if (!hops.empty()) {
-            hopCnt = 1;
-            for (char c : hops) if (c == ',') hopCnt++;
-        }
-        
-        if (hopCnt >= MAX_HOPS) {
-            Message msg = {content, from, to, "", time(nullptr), 0};
-            pthread_mutex_lock(&serverMutex);
-            messageQueue[to].push(msg);
-            pthread_mutex_unlock(&serverMutex);
-            return;
-        }
-        
-        if (to == MY_GROUP_ID) {
-            Message msg = {content, from, to, hops, time(nullptr), hopCnt};
-            pthread_mutex_lock(&serverMutex);
-            messageQueue[to].push(msg);
-            pthread_mutex_unlock(&serverMutex);
-            messagesReceived++;
-            logMessage("Received msg from " + from + " (hops:" + std::to_string(hopCnt) + ")");
-        } else {
-            bool fwd = false;
-            pthread_mutex_lock(&serverMutex);
-            for (const auto &p : connectedServers) {
-                if (p.second.groupId == to) {
-                    pthread_mutex_unlock(&serverMutex);
-                    std::string newHops = hops.empty() ? from : hops + "," + MY_GROUP_ID;
-                    if (sendCommand(p.first, buildSENDMSG(to, from, content, newHops))) {
-                        messagesForwarded++;
-                        logMessage("Forwarded " + from + "->" + to + " [" + std::to_string(messagesForwarded) + "]");
-                        fwd = true;
-                    }
-                    pthread_mutex_lock(&serverMutex);
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&serverMutex);
-            
-            if (!fwd) {
-                Message msg = {content, from, to, hops.empty() ? from : hops + "," + MY_GROUP_ID, time(nullptr), hopCnt + 1};
-                pthread_mutex_lock(&serverMutex);
-                messageQueue[to].push(msg);
-                for (const auto &p : connectedServers) {
-                    if (!p.second.groupId.empty() && !isInHops(msg.hops, p.second.groupId))
-                        sendCommand(p.first, buildSENDMSG(to, from, content, msg.hops));
-                }
-                pthread_mutex_unlock(&serverMutex);
-            }
+    else routePeerCommand(sock, tokens, hops);
+}
+
+// Every frame sent or received: per-peer counters for STATS, and receive/send spans when tracing
+void onFrame(int sock, const char *command, size_t length, bool outgoing, uint64_t elapsedUs) {
+    countPeerFrame(sock, command, length, outgoing, elapsedUs);
+    if (outgoing) framesSent.add();
+    if (tracing)
+        traceSpan(outgoing ? "send" : "receive", frameKindName(command, length), monotonicMicros() - elapsedUs, elapsedUs);
+}
+
+// STATS reply: value lines packed into as few STATS frames as fit, then STATS_END
+void sendStats(int sock, const std::vector<std::string> &lines) {
+    const size_t CHUNK = MAX_MESSAGE_LENGTH - 100;
+    std::string frame = "STATS";
+    for (const auto &line : lines) {
+        if (line.empty() || line[0] == '#') continue;
+        if (frame.size() + line.size() + 1 > CHUNK) {
+            if (!sendCommand(sock, frame)) return;
+            frame = "STATS";
         }
+        frame += "\n" + line;
     }
-    else if (tokens[0] == "STATUSREQ") {
-        logMessage("STATUSREQ received");
-        pthread_mutex_lock(&serverMutex);
-        std::vector<std::pair<std::string, int>> status;
-        for (const auto &p : messageQueue)
-            if (!p.second.empty())
-                status.push_back({p.first, p.second.size()});
-        pthread_mutex_unlock(&serverMutex);
-        sendCommand(sock, buildSTATUSRESP(status));
-    }
-    else if (tokens[0] == "STATUSRESP") {
-        logMessage("STATUSRESP: " + main);
-    }
-    else if (tokens[0] == "NO_MESSAGES") {
-        logMessage("NO_MESSAGES from peer");
-    }
+    if (frame.size() > 5) sendCommand(sock, frame);
+    sendCommand(sock, "STATS_END");
 }
 
 void handleClientCommand(int sock, const std::string &cmd) {
     std::vector<std::string> tokens = parseCommand(cmd);
     if (tokens.empty()) return;
+    clientCommands.add();
+    TraceSpan clientSpan("client", frameKindName(cmd.data(), cmd.size()));
     
     if (tokens[0] == "SENDMSG" && tokens.size() >= 3) {
         std::string to = tokens[1], msg;
@@ -565,90 +1025,258 @@ void handleClientCommand(int sock, const std::string &cmd) {
             if (i < tokens.size() - 1) msg += ",";
         }
         
-        bool fwd = false;
-        pthread_mutex_lock(&serverMutex);
-        for (const auto &p : connectedServers) {
-            if (p.second.groupId == to) {
-                pthread_mutex_unlock(&serverMutex);
-                if (sendCommand(p.first, buildSENDMSG(to, MY_GROUP_ID, msg, MY_GROUP_ID))) {
-                    messagesSent++;
-                    fwd = true;
-                }
-                pthread_mutex_lock(&serverMutex);
-                break;
-            }
-        }
-        pthread_mutex_unlock(&serverMutex);
-        
-        if (!fwd) {
-            Message m = {msg, MY_GROUP_ID, to, MY_GROUP_ID, time(nullptr), 1};
-            pthread_mutex_lock(&serverMutex);
-            messageQueue[to].push(m);
-            for (const auto &p : connectedServers)
-                if (!p.second.groupId.empty())
-                    sendCommand(p.first, buildSENDMSG(to, MY_GROUP_ID, msg, MY_GROUP_ID));
-            pthread_mutex_unlock(&serverMutex);
-        }
+        PROFILED_LOCK(serverMutex);
+        RouteAction action = router.originate(to, msg);
+        OutboxBatch out = takeOutboxLocked();
+        PROFILED_UNLOCK(serverMutex);
+        // A direct send that fails is queued and flooded by flushOutbox
+        bool fwd = flushOutbox(out) > 0 && action == ROUTE_FORWARDED;
         sendCommand(sock, fwd ? "OK,Delivered" : "OK,Queued");
     }
     else if (tokens[0] == "GETMSG") {
-        pthread_mutex_lock(&serverMutex);
-        bool has = !messageQueue[MY_GROUP_ID].empty();
-        pthread_mutex_unlock(&serverMutex);
+        Message msg;
+        std::shared_ptr<GroupLatency> latency;
+        PROFILED_LOCK(serverMutex);
+        bool has = router.dequeue(MY_GROUP_ID, msg);
+        if (has) latency = groupLatencyLocked(MY_GROUP_ID);
+        PROFILED_UNLOCK(serverMutex);
         if (has) {
-            pthread_mutex_lock(&serverMutex);
-            Message msg = messageQueue[MY_GROUP_ID].front();
-            messageQueue[MY_GROUP_ID].pop();
-            pthread_mutex_unlock(&serverMutex);
-            sendCommand(sock, buildSENDMSG(MY_GROUP_ID, msg.fromGroup, msg.content));
+            if (sendCommand(sock, buildSENDMSG(MY_GROUP_ID, msg.fromGroup, msg.content)))
+                recordDelivery(latency, msg.timestamp);
         } else sendCommand(sock, "NO_MESSAGES");
     }
     else if (tokens[0] == "LISTSERVERS") {
-        pthread_mutex_lock(&serverMutex);
-        std::vector<std::tuple<std::string, std::string, int>> list;
-        list.push_back(std::make_tuple(MY_GROUP_ID, myIpAddress, listenPort));
-        for (const auto &p : connectedServers)
-            if (!p.second.groupId.empty() && p.second.port > 0)  // Only show if we know their port
-                list.push_back(std::make_tuple(p.second.groupId, p.second.ip, p.second.port));
-        pthread_mutex_unlock(&serverMutex);
-        sendCommand(sock, buildSERVERS(list));
+        PROFILED_LOCK(serverMutex);
+        std::shared_ptr<const std::string> list = serversCacheLocked().frame;
+        PROFILED_UNLOCK(serverMutex);
+        sendFrame(sock, *list);
+    }
+    else if (tokens[0] == "TRACE") {
+        int spans = tracing ? writeTrace(tracePath) : -1;
+        if (spans >= 0) logMessage("Trace: " + std::to_string(spans) + " spans written to " + tracePath);
+        sendCommand(sock, !tracing ? "ERROR,Tracing is off (--trace)" :
+                          spans < 0 ? "ERROR,Could not write " + tracePath :
+                          "OK," + tracePath + "," + std::to_string(spans));
+    }
+    else if (tokens[0] == "STATS" && tokens.size() >= 2 && tokens[1] == "LOCKS") {
+        std::vector<std::string> lines = lockProfileLines();
+        if (lines.empty()) lines.push_back(lockProfiling ? "no lock sites hit yet" : "lock profiling is off (--lock-profile)");
+        sendStats(sock, lines);
+    }
+    else if (tokens[0] == "STATS") {
+        std::vector<std::string> lines = renderMetrics();
+        PROFILED_LOCK(serverMutex);
+        time_t now = time(nullptr);
+        for (const auto &p : connectedServers) {
+            const ServerInfo &s = p.second;
+            samplePeerTcp(s.socket);
+            lines.push_back("peer{group=\"" + s.groupId + "\",addr=\"" + s.ip + ":" + std::to_string(s.port) +
+                            "\",dir=\"" + (s.isOutgoing ? "out" : "in") + "\"} handshake_ms=" +
+                            std::to_string(s.handshakeMs) + " up_s=" + std::to_string(now - s.connectedSince) +
+                            " " + formatPeerStats(peerStats(s.socket)));
+        }
+        for (const auto &h : deliveredByHops)
+            lines.push_back("delivered_hops{hops=\"" + std::to_string(h.first) + "\"} " + std::to_string(h.second));
+        for (const auto &g : groupLatency) {
+            const Histogram &r = g.second->residence, &d = g.second->delivery;
+            lines.push_back("group{group=\"" + g.first + "\"} residence_n=" + std::to_string(r.count()) +
+                            " residence_p50_us=" + std::to_string(r.percentile(0.5)) +
+                            " residence_p99_us=" + std::to_string(r.percentile(0.99)) +
+                            " residence_max_us=" + std::to_string(r.max()) +
+                            " delivery_n=" + std::to_string(d.count()) +
+                            " delivery_p50_us=" + std::to_string(d.percentile(0.5)) +
+                            " delivery_p99_us=" + std::to_string(d.percentile(0.99)) +
+                            " delivery_max_us=" + std::to_string(d.max()));
+        }
+        PROFILED_UNLOCK(serverMutex);
+        sendStats(sock, lines);
     }
 }
 
+struct PushJob {
+    int sock;
+    unsigned long connId;  // The connection the backlog is for; a reused descriptor is not it
+    std::string groupId;
+};
+
+// Drains the backlog queued for a newly connected peer, one paced frame at a time
+void *backlogPushThread(void *arg) {
+    PushJob *job = (PushJob *)arg;
+    int sock = job->sock;
+    unsigned long connId = job->connId;
+    std::string gid = job->groupId;
+    delete job;
+    
+    usleep(PUSH_DELAY_MS * 1000);
+    int pushed = 0;
+    uint64_t totalWait = 0, maxWait = 0;
+    while (true) {
+        Message msg;
+        PROFILED_LOCK(serverMutex);
+        ServerInfo *peer = findPeer(sock, connId);
+        if (!peer || peer->groupId != gid || !router.dequeue(gid, msg)) {
+            PROFILED_UNLOCK(serverMutex);
+            break;
+        }
+        std::shared_ptr<GroupLatency> latency = groupLatencyLocked(gid);
+        PROFILED_UNLOCK(serverMutex);
+        
+        if (!sendToPeer(sock, buildSENDMSG(gid, msg.fromGroup, msg.content, msg.hops))) {
+            PROFILED_LOCK(serverMutex);
+            router.requeue(msg, false);
+            PROFILED_UNLOCK(serverMutex);
+            break;
+        }
+        recordDelivery(latency, msg.timestamp);
+        uint64_t wait = (monotonicMicros() - msg.timestamp) / 1000;
+        totalWait += wait;
+        maxWait = std::max(maxWait, wait);
+        pushed++;
+        messagesForwarded.add();
+        usleep(PUSH_PACING_MS * 1000);
+    }
+    if (pushed > 0)
+        logMessage("Pushed " + std::to_string(pushed) + " queued msgs to " + gid + " (avg wait " +
+                   std::to_string(totalWait / pushed) + "ms, max " + std::to_string(maxWait) + "ms)");
+    return NULL;
+}
+
+// Called once a group is registered as a direct peer (inbound HELO or outbound SERVERS)
+void onPeerRegistered(int sock, const std::string &groupId) {
+    PROFILED_LOCK(serverMutex);
+    auto it = connectedServers.find(sock);
+    unsigned long connId = it != connectedServers.end() ? it->second.connId : 0;
+    if (connId) schedulePeerTimers(sock, connId);
+    bool hasBacklog = connId && groupId != MY_GROUP_ID && router.queuedFor(groupId) > 0;
+    PROFILED_UNLOCK(serverMutex);
+    
+    // Ask what the peer holds; its STATUSRESP drives any GETMSGS for us
+    sendCommand(sock, buildSTATUSREQ());
+    if (!hasBacklog) return;
+    
+    PushJob *job = new PushJob{sock, connId, groupId};
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, backlogPushThread, job) == 0) pthread_detach(tid);
+    else delete job;
+}
+
 void *peerCommunicationThread(void *arg) {
     int sock = *(int *)arg;
     delete (int *)arg;
     std::string cmd;
     while (receiveCommand(sock, cmd)) {
+        uint64_t started = monotonicMicros();
         handleServerCommand(sock, cmd);
-        pthread_mutex_lock(&serverMutex);
-        if (connectedServers.find(sock) != connectedServers.end())
-            connectedServers[sock].lastSeen = time(nullptr);
-        pthread_mutex_unlock(&serverMutex);
+        handlerTime.record(monotonicMicros() - started);
+        framesReceived.add();
+        PROFILED_LOCK(serverMutex);
+        auto it = connectedServers.find(sock);
+        if (it != connectedServers.end()) {
+            it->second.lastSeen = time(nullptr);
+            if (it->second.port > 0) neighborStatsLocked(it->second.ip, it->second.port).bytesIn += cmd.size() + 5;
+        }
+        PROFILED_UNLOCK(serverMutex);
     }
-    pthread_mutex_lock(&serverMutex);
+    PROFILED_LOCK(serverMutex);
     std::string gid;
     if (connectedServers.find(sock) != connectedServers.end()) {
         gid = connectedServers[sock].groupId;
+        closeNeighborStatsLocked(connectedServers[sock]);
+        connManager.recordDisconnect(connectedServers[sock].ip, connectedServers[sock].port, monotonicMillis());
         connectedGroupIds.erase(gid);
+        forgetGroupLatencyLocked(gid);
         connectedServers.erase(sock);
+        membershipVersion++;
         lastHeloAttempt.erase(gid); // Clean up rate limit tracking
+        pthread_cond_signal(&connCond);
     }
-    pthread_mutex_unlock(&serverMutex);
+    router.removePeer(sock);
+    peerProbes.erase(sock);
+    PROFILED_UNLOCK(serverMutex);
     if (!gid.empty()) logMessage("Peer " + gid + " disconnected");
     close(sock);
     return NULL;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) { printf("Usage: %s <port> [--scan] [server_ip:port] ...\n", argv[0]); exit(0); }
+    if (argc < 2) { printf("Usage: %s <port> [--scan] [--syn-scan] [--ttl=<sec>] [--detect=<sec>] [--probe]\n"
+                           "       [--min-peers=N] [--max-peers=N] [--students=N] [--instructors=N] [--handshakes=N]\n"
+                           "       [--neighbor-score=latency|port] [--no-snapshot] [--metrics-port=N] [--lock-profile] [--trace]\n"
+                           "       [--group=<id>] [--offline]\n"
+                           "       [server_ip:port] ...\n", argv[0]); exit(0); }
     
     // Ignore SIGPIPE to prevent crashes on disconnected sockets
     signal(SIGPIPE, SIG_IGN);
     
+    // Block shutdown and trace signals before any thread starts; signalThread takes them
+    static sigset_t shutdownSignals;
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGINT);
+    sigaddset(&shutdownSignals, SIGTERM);
+    sigaddset(&shutdownSignals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, NULL);
+    
     listenPort = atoi(argv[1]);
     myIpAddress = getLocalIPAddress();
-    bool doScan = false;
+    std::vector<std::string> initialPeers;
+    int metricsPort = 0;
+    
+    router.ttlSeconds = DEFAULT_MESSAGE_TTL;
+    router.onQueue = onQueueEvent;
+    
+    // Options first so they apply to every connection, including the initial ones
+    for (int i = 2; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--scan") discovery.config.continuous = true;
+        else if (arg == "--syn-scan") discovery.config.synScan = true;
+        else if (arg.compare(0, 6, "--ttl=") == 0) router.ttlSeconds = atoi(arg.c_str() + 6);
+        else if (arg.compare(0, 9, "--detect=") == 0) detectSeconds = std::max(1, atoi(arg.c_str() + 9));
+        else if (arg == "--probe") probeEnabled = true;
+        else if (arg == "--no-snapshot") snapshotPath.clear();
+        else if (arg == "--lock-profile") lockProfiling = true;
+        else if (arg == "--trace") tracing = true;
+        else if (arg == "--offline") offline = true;
+        else if (arg.compare(0, 8, "--group=") == 0 && arg.size() > 8) {
+            MY_GROUP_ID = arg.substr(8);
+            router.groupId = MY_GROUP_ID;
+            if (!snapshotPath.empty()) snapshotPath = MY_GROUP_ID + "_peers.snapshot";
+            tracePath = MY_GROUP_ID + "_trace.json";
+        }
+        else if (arg.compare(0, 15, "--metrics-port=") == 0) metricsPort = atoi(arg.c_str() + 15);
+        else if (arg.compare(0, 13, "--handshakes=") == 0) setHandshakeConcurrency(atoi(arg.c_str() + 13));
+        else if (arg.compare(0, 12, "--min-peers=") == 0) connManager.targets.minPeers = atoi(arg.c_str() + 12);
+        else if (arg.compare(0, 12, "--max-peers=") == 0) connManager.targets.maxPeers = atoi(arg.c_str() + 12);
+        else if (arg.compare(0, 11, "--students=") == 0) connManager.targets.preferredStudents = atoi(arg.c_str() + 11);
+        else if (arg.compare(0, 14, "--instructors=") == 0) connManager.targets.preferredInstructors = atoi(arg.c_str() + 14);
+        else if (arg.compare(0, 17, "--neighbor-score=") == 0) {
+            NeighborScorer scorer = neighborScorerByName(arg.substr(17));
+            if (scorer) neighborScorer = scorer;
+            else printf("Unknown neighbor scorer %s, using latency\n", arg.c_str() + 17);
+        }
+        else if (arg.find(':') != std::string::npos) initialPeers.push_back(arg);
+    }
+    
+    // When the directory is full, live peers stay and unreliable servers go first
+    directory.pinned = [](const DirectoryEntry &e) {
+        if (connectedGroupIds.count(e.groupId)) return true;
+        for (const auto &p : connectedServers)
+            if (p.second.ip == e.ip && p.second.port == e.port) return true;
+        return false;
+    };
+    // What we measured about a server is forgotten with it
+    directory.onRemove = [](const DirectoryEntry &e) {
+        std::string key = e.ip + ":" + std::to_string(e.port);
+        neighborStats.erase(key);
+        candidateCache.erase(key);
+        rescoreKeys.erase(key);
+        connManager.forget(e.ip, e.port);
+        if (!e.groupId.empty()) forgetGroupLatencyLocked(e.groupId);
+    };
+    directory.quality = [](const DirectoryEntry &e) {
+        auto it = neighborStats.find(e.ip + ":" + std::to_string(e.port));
+        if (it == neighborStats.end()) return 0.5;
+        return (it->second.dialsOk + 1.0) / (it->second.dialsOk + it->second.dialsFailed + 2.0);
+    };
     
     logFile.open(MY_GROUP_ID + "_server.log", std::ios::app);
     logMessage("======================================");
@@ -658,26 +1286,56 @@ int main(int argc, char *argv[]) {
     
     int listenSock = open_socket(listenPort);
     if (listenSock < 0 || listen(listenSock, 10) < 0) exit(1);
+    setFrameObserver(onFrame);
+    if (metricsPort > 0) {
+        if (startMetricsServer(metricsPort)) logMessage("Metrics on 127.0.0.1:" + std::to_string(metricsPort));
+        else logMessage("Could not serve metrics on port " + std::to_string(metricsPort));
+    }
     
-    pthread_t hThread;
+    pthread_t hThread, sThread;
     if (pthread_create(&hThread, NULL, healthMonitorThread, NULL) == 0) pthread_detach(hThread);
+    if (pthread_create(&sThread, NULL, signalThread, &shutdownSignals) == 0) pthread_detach(sThread);
     
-    for (int i = 2; i < argc; i++) {
-        std::string arg(argv[i]);
-        if (arg == "--scan") { doScan = true; continue; }
-        size_t pos = arg.find(':');
-        if (pos != std::string::npos) {
-            connectToServer(arg.substr(0, pos), std::stoi(arg.substr(pos + 1)));
-            sleep(2);
-        }
+    // Discovery sweeps in the background while the initial peers are dialed
+    if (!offline) discovery.addRange(TSAM_SERVER_IP, 4000, 4200, listenPort);
+    discovery.start();
+    if (discovery.config.continuous) discovery.requestSweep();
+    
+    std::vector<HandshakeTarget> initialTargets;
+    for (const auto &peer : initialPeers) {
+        size_t pos = peer.find(':');
+        initialTargets.push_back({peer.substr(0, pos), std::stoi(peer.substr(pos + 1))});
     }
     
-    if (doScan) triggerScan();
-    else {
-        pthread_mutex_lock(&serverMutex);
-        if (connectedServers.size() == 0) { pthread_mutex_unlock(&serverMutex); connectToServer(TSAM_SERVER_IP, 5001); }
-        else pthread_mutex_unlock(&serverMutex);
+    // Warm start: remember last run's servers and dial the best of them with the command-line peers
+    std::vector<SnapshotEntry> warm;
+    if (!snapshotPath.empty()) warm = rankSnapshot(loadSnapshot(snapshotPath, SNAPSHOT_MAX_AGE));
+    int warmDials = 0;
+    PROFILED_LOCK(serverMutex);
+    for (const auto &e : warm) {
+        if (e.groupId == MY_GROUP_ID || (e.ip == myIpAddress && e.port == listenPort)) continue;
+        directory.upsert(e.groupId, e.ip, e.port, e.lastSeen);
+        NeighborStats &ns = neighborStatsLocked(e.ip, e.port);
+        ns.metrics.connectRttMs = e.rttMs;
+        ns.dialsOk = e.successes;
+        ns.dialsFailed = e.failures;
+        bool listed = false;
+        for (const auto &t : initialTargets)
+            if (t.ip == e.ip && t.port == e.port) { listed = true; break; }
+        if (!listed && (int)initialTargets.size() < connManager.targets.maxPeers) {
+            initialTargets.push_back({e.ip, e.port});
+            warmDials++;
+        }
     }
+    PROFILED_UNLOCK(serverMutex);
+    if (!warm.empty())
+        logMessage("Warm start: " + std::to_string(warm.size()) + " servers from " + snapshotPath +
+                   ", dialing the best " + std::to_string(warmDials));
+    if (!initialTargets.empty()) connectToServers(initialTargets);
+    
+    // The manager tops up to the target degree from known servers and instructor ports
+    pthread_t mThread;
+    if (pthread_create(&mThread, NULL, connectionManagerThread, NULL) == 0) pthread_detach(mThread);
     
     logMessage("Ready - listening for connections");
     
@@ -686,6 +1344,8 @@ int main(int argc, char *argv[]) {
         socklen_t len = sizeof(client);
         int cSock = accept(listenSock, (struct sockaddr *)&client, &len);
         if (cSock < 0) continue;
+        uint64_t acceptedAt = monotonicMillis();
+        resetPeerStats(cSock);
         
         logMessage("Accepted connection from " + std::string(inet_ntoa(client.sin_addr)) + 
                    ":" + std::to_string(ntohs(client.sin_port)));
@@ -694,36 +1354,44 @@ int main(int argc, char *argv[]) {
         if (receiveCommand(cSock, cmd)) {
             std::vector<std::string> tokens = parseCommand(cmd);
             if (!tokens.empty() && tokens[0] == "HELO") {
-                pthread_mutex_lock(&serverMutex);
-                connectedServers[cSock] = {cSock, "", inet_ntoa(client.sin_addr), 0, time(nullptr), time(nullptr), false, false};
-                pthread_mutex_unlock(&serverMutex);
+                PROFILED_LOCK(serverMutex);
+                connectedServers[cSock] = {cSock, "", inet_ntoa(client.sin_addr), 0, time(nullptr), time(nullptr), false, false,
+                                           nextConnId++, 0};
+                PROFILED_UNLOCK(serverMutex);
                 
                 handleServerCommand(cSock, cmd);
                 
                 // Check if HELO was accepted (socket still in connectedServers with groupId set)
-                pthread_mutex_lock(&serverMutex);
+                PROFILED_LOCK(serverMutex);
                 bool accepted = (connectedServers.find(cSock) != connectedServers.end() && 
                                 !connectedServers[cSock].groupId.empty());
-                pthread_mutex_unlock(&serverMutex);
+                std::string gid = accepted ? connectedServers[cSock].groupId : "";
+                if (accepted) connectedServers[cSock].handshakeMs = monotonicMillis() - acceptedAt;
+                PROFILED_UNLOCK(serverMutex);
                 
                 if (accepted) {
+                    enableFailureDetection(cSock, detectSeconds);
                     pthread_t tid;
                     int *ptr = new int(cSock);
                     if (pthread_create(&tid, NULL, peerCommunicationThread, ptr) == 0) {
                         pthread_detach(tid);
+                        onPeerRegistered(cSock, gid);
                     } else {
                         delete ptr;
                         close(cSock);
-                        pthread_mutex_lock(&serverMutex);
+                        PROFILED_LOCK(serverMutex);
                         connectedServers.erase(cSock);
-                        pthread_mutex_unlock(&serverMutex);
+                        connectedGroupIds.erase(gid);
+                        router.removePeer(cSock);
+                        membershipVersion++;
+                        PROFILED_UNLOCK(serverMutex);
                     }
                 } else {
                     // HELO was rejected, clean up
                     close(cSock);
-                    pthread_mutex_lock(&serverMutex);
+                    PROFILED_LOCK(serverMutex);
                     connectedServers.erase(cSock);
-                    pthread_mutex_unlock(&serverMutex);
+                    PROFILED_UNLOCK(serverMutex);
                 }
             } else {
                 handleClientCommand(cSock, cmd);
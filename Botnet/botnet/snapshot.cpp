@@ -0,0 +1,57 @@
+#include "snapshot.h"
+#include "protocol.h"
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+static const char *HEADER = "# peer snapshot v1: group,ip,port,lastSeen,rttMs,successes,failures";
+
+bool saveSnapshot(const std::string &path, const std::vector<SnapshotEntry> &entries) {
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp.c_str(), std::ios::trunc);
+    if (!out) return false;
+    out << HEADER << "\n";
+    for (const auto &e : entries) {
+        char rtt[32];
+        snprintf(rtt, sizeof(rtt), "%.1f", e.rttMs);
+        out << e.groupId << "," << e.ip << "," << e.port << "," << (long long)e.lastSeen << ","
+            << rtt << "," << e.successes << "," << e.failures << "\n";
+    }
+    out.close();
+    if (!out) { remove(tmp.c_str()); return false; }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+std::vector<SnapshotEntry> loadSnapshot(const std::string &path, time_t maxAge) {
+    std::vector<SnapshotEntry> entries;
+    std::ifstream in(path.c_str());
+    std::string line;
+    time_t now = time(nullptr);
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::vector<std::string> f = parseCommand(line);
+        if (f.size() != 7 || f[1].empty()) continue;
+        SnapshotEntry e = {f[0], f[1], atoi(f[2].c_str()), (time_t)atoll(f[3].c_str()),
+                           atof(f[4].c_str()), atoi(f[5].c_str()), atoi(f[6].c_str())};
+        if (e.port <= 0 || e.port > 65535 || now - e.lastSeen > maxAge) continue;
+        entries.push_back(e);
+    }
+    return entries;
+}
+
+// Laplace-smoothed, so an unknown server ranks between good and bad ones
+static double successRate(const SnapshotEntry &e) {
+    return (e.successes + 1.0) / (e.successes + e.failures + 2.0);
+}
+
+std::vector<SnapshotEntry> rankSnapshot(std::vector<SnapshotEntry> entries) {
+    std::stable_sort(entries.begin(), entries.end(), [](const SnapshotEntry &a, const SnapshotEntry &b) {
+        double sa = successRate(a), sb = successRate(b);
+        if (sa != sb) return sa > sb;
+        if (a.lastSeen != b.lastSeen) return a.lastSeen > b.lastSeen;
+        double ra = a.rttMs < 0 ? 1e9 : a.rttMs, rb = b.rttMs < 0 ? 1e9 : b.rttMs;
+        return ra < rb;
+    });
+    return entries;
+}
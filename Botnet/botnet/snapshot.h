@@ -0,0 +1,43 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+/**
+ * One known server as remembered between runs
+ */
+struct SnapshotEntry {
+    std::string groupId, ip;  // groupId may be empty for servers only seen by discovery
+    int port;
+    time_t lastSeen;
+    double rttMs;             // Last smoothed connect RTT, -1 if never connected
+    int successes, failures;  // Dial outcomes
+};
+
+/**
+ * Write the snapshot atomically (temp file + rename), one entry per line:
+ * group,ip,port,lastSeen,rttMs,successes,failures
+ * @param path Snapshot file
+ * @param entries Servers to remember
+ * @return true if the file was replaced
+ */
+bool saveSnapshot(const std::string &path, const std::vector<SnapshotEntry> &entries);
+
+/**
+ * Read a snapshot, skipping malformed lines and entries not seen within maxAge
+ * @param path Snapshot file
+ * @param maxAge Oldest lastSeen to keep, in seconds
+ * @return Entries, empty if the file is missing
+ */
+std::vector<SnapshotEntry> loadSnapshot(const std::string &path, time_t maxAge);
+
+/**
+ * Rank entries for a warm start: best dial success rate first,
+ * then most recently seen, then lowest RTT
+ * @return Entries sorted best first
+ */
+std::vector<SnapshotEntry> rankSnapshot(std::vector<SnapshotEntry> entries);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,100 @@
+#include "timerwheel.h"
+#include <time.h>
+
+uint64_t monotonicMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+TimerWheel::TimerWheel(uint64_t tickMs, uint64_t startMs)
+    : tickMs(tickMs), startMs(startMs), currentTick(0), nextId(1) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+TimerWheel::~TimerWheel() {
+    pthread_mutex_destroy(&mutex);
+}
+
+TimerWheel::TimerId TimerWheel::schedule(uint64_t delayMs, Callback cb) {
+    uint64_t ticks = (delayMs + tickMs - 1) / tickMs;
+    if (ticks == 0) ticks = 1;  // Never fire inside the tick that scheduled it
+
+    pthread_mutex_lock(&mutex);
+    TimerId id = nextId++;
+    Timer t = {currentTick + ticks, cb};
+    timers[id] = t;
+    place(id, t.expiryTick);
+    pthread_mutex_unlock(&mutex);
+    return id;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+    // The slot entry is left behind and skipped when its slot comes round
+    pthread_mutex_lock(&mutex);
+    bool found = timers.erase(id) > 0;
+    pthread_mutex_unlock(&mutex);
+    return found;
+}
+
+size_t TimerWheel::pending() {
+    pthread_mutex_lock(&mutex);
+    size_t n = timers.size();
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+// Caller holds mutex
+void TimerWheel::place(TimerId id, uint64_t expiryTick) {
+    uint64_t delta = expiryTick > currentTick ? expiryTick - currentTick : 0;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1))))
+        level++;
+
+    // Beyond the top level: park in the furthest slot and re-place on cascade
+    uint64_t span = 1ULL << (SLOT_BITS * LEVELS);
+    uint64_t at = delta < span ? expiryTick : currentTick + span - 1;
+    slots[level][(at >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(id);
+}
+
+// Caller holds mutex. Re-places every timer in the current slot of a level.
+void TimerWheel::cascade(int level) {
+    std::vector<TimerId> moving;
+    moving.swap(slots[level][(currentTick >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+    for (TimerId id : moving) {
+        auto it = timers.find(id);
+        if (it != timers.end()) place(id, it->second.expiryTick);
+    }
+}
+
+void TimerWheel::advance(uint64_t nowMs) {
+    std::vector<Callback> due;
+
+    pthread_mutex_lock(&mutex);
+    uint64_t target = nowMs > startMs ? (nowMs - startMs) / tickMs : 0;
+    while (currentTick < target) {
+        currentTick++;
+
+        // Cascade from the top when lower levels wrap around
+        for (int level = LEVELS - 1; level > 0; level--) {
+            if ((currentTick & ((1ULL << (SLOT_BITS * level)) - 1)) == 0)
+                cascade(level);
+        }
+
+        std::vector<TimerId> slot;
+        slot.swap(slots[0][currentTick & (SLOTS - 1)]);
+        for (TimerId id : slot) {
+            auto it = timers.find(id);
+            if (it == timers.end()) continue;  // Cancelled
+            if (it->second.expiryTick <= currentTick) {
+                due.push_back(it->second.cb);
+                timers.erase(it);
+            } else {
+                place(id, it->second.expiryTick);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    for (auto &cb : due) cb();
+}
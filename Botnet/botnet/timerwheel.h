@@ -0,0 +1,79 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * Milliseconds from a monotonic clock (unaffected by wall-clock changes)
+ */
+uint64_t monotonicMillis();
+
+/**
+ * Hierarchical timer wheel (4 levels x 64 slots).
+ * Level 0 holds timers due within 64 ticks; higher levels hold later
+ * timers and are cascaded down as the wheel turns, so scheduling,
+ * cancelling and firing are O(1) per timer regardless of how many exist.
+ *
+ * Thread-safe: any thread may schedule or cancel. Callbacks run on the
+ * thread calling advance(), outside the internal lock, so they may
+ * schedule new timers.
+ */
+class TimerWheel {
+public:
+    typedef std::function<void()> Callback;
+    typedef uint64_t TimerId;
+
+    /**
+     * @param tickMs Resolution of the wheel in milliseconds
+     * @param startMs Current monotonic time (see monotonicMillis)
+     */
+    TimerWheel(uint64_t tickMs, uint64_t startMs);
+    ~TimerWheel();
+
+    /**
+     * Schedule a callback to run once after delayMs (rounded up to a tick)
+     * @return Id usable with cancel()
+     */
+    TimerId schedule(uint64_t delayMs, Callback cb);
+
+    /**
+     * Cancel a pending timer
+     * @return true if the timer was pending
+     */
+    bool cancel(TimerId id);
+
+    /**
+     * Turn the wheel up to nowMs and run every timer that became due
+     */
+    void advance(uint64_t nowMs);
+
+    /**
+     * Number of timers still pending
+     */
+    size_t pending();
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    struct Timer {
+        uint64_t expiryTick;
+        Callback cb;
+    };
+
+    void place(TimerId id, uint64_t expiryTick);
+    void cascade(int level);
+
+    uint64_t tickMs, startMs, currentTick;
+    TimerId nextId;
+    std::unordered_map<TimerId, Timer> timers;
+    std::vector<TimerId> slots[LEVELS][SLOTS];
+    pthread_mutex_t mutex;
+};
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,134 @@
+#include "trace.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+
+const size_t TRACE_RING_EVENTS = 8192;  // Per thread; about 400 KB
+
+bool tracing = false;
+
+// One slot; seq is odd while the owner rewrites it, so the dumper can skip torn reads
+struct TraceEvent {
+    std::atomic<uint64_t> seq;
+    std::atomic<const char *> name, detail;
+    std::atomic<uint64_t> startUs, durUs;
+    std::atomic<int> tid;
+};
+
+struct TraceRing {
+    TraceEvent events[TRACE_RING_EVENTS];
+    std::atomic<uint64_t> head;  // Spans ever written
+    bool owned;                  // Guarded by ringsMutex
+};
+
+// Rings outlive their threads: a new thread reuses a released ring, so
+// short-lived peer threads do not grow memory and their spans stay dumpable
+static std::vector<TraceRing *> rings;
+static pthread_mutex_t ringsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct RingHolder {
+    TraceRing *ring = nullptr;
+    int tid = 0;
+    ~RingHolder() {
+        if (!ring) return;
+        pthread_mutex_lock(&ringsMutex);
+        ring->owned = false;
+        pthread_mutex_unlock(&ringsMutex);
+    }
+};
+
+static TraceRing *threadRing(int &tid) {
+    thread_local RingHolder holder;
+    if (!holder.ring) {
+        pthread_mutex_lock(&ringsMutex);
+        for (TraceRing *r : rings)
+            if (!r->owned) { holder.ring = r; break; }
+        if (!holder.ring) {
+            holder.ring = new TraceRing();
+            rings.push_back(holder.ring);
+        }
+        holder.ring->owned = true;
+        pthread_mutex_unlock(&ringsMutex);
+        holder.tid = static_cast<int>(syscall(SYS_gettid));
+    }
+    tid = holder.tid;
+    return holder.ring;
+}
+
+void traceSpan(const char *name, const char *detail, uint64_t startUs, uint64_t durUs) {
+    if (!tracing) return;
+    int tid;
+    TraceRing *ring = threadRing(tid);
+    const std::memory_order relaxed = std::memory_order_relaxed;
+    uint64_t n = ring->head.load(relaxed);
+    TraceEvent &e = ring->events[n % TRACE_RING_EVENTS];
+    uint64_t seq = e.seq.load(relaxed);
+    e.seq.store(seq + 1, relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e.name.store(name, relaxed);
+    e.detail.store(detail, relaxed);
+    e.startUs.store(startUs, relaxed);
+    e.durUs.store(durUs, relaxed);
+    e.tid.store(tid, relaxed);
+    e.seq.store(seq + 2, std::memory_order_release);
+    ring->head.store(n + 1, std::memory_order_release);
+}
+
+TraceSpan::TraceSpan(const char *name, const char *detail)
+    : detail(detail), name(name), startUs(tracing ? monotonicMicros() : 0) {}
+
+TraceSpan::~TraceSpan() {
+    if (tracing) traceSpan(name, detail, startUs, monotonicMicros() - startUs);
+}
+
+// Span names and details are literals, but keep the JSON valid regardless
+static std::string jsonString(const char *s) {
+    std::string out = "\"";
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') out += '\\';
+        if (static_cast<unsigned char>(*s) >= 0x20) out += *s;
+    }
+    return out + "\"";
+}
+
+int writeTrace(const std::string &path) {
+    pthread_mutex_lock(&ringsMutex);
+    std::vector<TraceRing *> snapshot = rings;
+    pthread_mutex_unlock(&ringsMutex);
+
+    std::string tmp = path + ".tmp";
+    std::ofstream out(tmp.c_str(), std::ios::trunc);
+    if (!out) return -1;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    int written = 0;
+    for (TraceRing *ring : snapshot) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        for (uint64_t i = first; i < head; i++) {
+            const TraceEvent &e = ring->events[i % TRACE_RING_EVENTS];
+            uint64_t seq = e.seq.load(std::memory_order_acquire);
+            const char *name = e.name.load(std::memory_order_relaxed);
+            const char *detail = e.detail.load(std::memory_order_relaxed);
+            uint64_t start = e.startUs.load(std::memory_order_relaxed);
+            uint64_t dur = e.durUs.load(std::memory_order_relaxed);
+            int tid = e.tid.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((seq & 1) || seq != e.seq.load(std::memory_order_relaxed) || !name) continue;
+
+            std::string label = detail ? std::string(name) + " " + detail : name;
+            out << (written ? ",\n" : "\n") << "{\"name\":" << jsonString(label.c_str())
+                << ",\"cat\":" << jsonString(name) << ",\"ph\":\"X\",\"ts\":" << start << ",\"dur\":" << dur
+                << ",\"pid\":" << getpid() << ",\"tid\":" << tid << "}";
+            written++;
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    if (!out || rename(tmp.c_str(), path.c_str()) != 0) return -1;
+    return written;
+}
@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <cstdint>
+
+/**
+ * Tracing switch (--trace). While off, spans cost one branch and no
+ * buffers are allocated.
+ */
+extern bool tracing;
+
+/**
+ * Record a finished span on the calling thread's ring buffer.
+ * Each thread writes only its own ring (no locks); the oldest spans are
+ * overwritten once the ring is full.
+ *
+ * @param name Stage, e.g. "handle" (must be a string literal or otherwise static)
+ * @param detail Optional static detail such as the command name, or nullptr
+ * @param startUs monotonicMicros() when the span began
+ * @param durUs Span length in microseconds
+ */
+void traceSpan(const char *name, const char *detail, uint64_t startUs, uint64_t durUs);
+
+/**
+ * Span covering the enclosing scope
+ */
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name, const char *detail = nullptr);
+    ~TraceSpan();
+
+    const char *detail;  // May be set once known (e.g. after decoding)
+
+private:
+    const char *name;
+    uint64_t startUs;
+};
+
+/**
+ * Write every buffered span as Chrome trace_event JSON (complete "X"
+ * events, one tid per thread), for chrome://tracing or Perfetto
+ * @return Number of spans written, or -1 if the file could not be written
+ */
+int writeTrace(const std::string &path);
+
+#endif // TRACE_H